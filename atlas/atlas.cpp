@@ -0,0 +1,261 @@
+#include "atlas.hpp"
+
+namespace /* anonymous namespace */
+{
+	// transparent border around every image so neighbours never bleed into each other
+	constexpr long padding = 1;
+};
+
+Atlas::Atlas(IDirect3DDevice9 *device, long page_size) :
+	device(device), page_size(page_size)
+{
+	if (!device)
+		throw std::exception("Atlas::ctor: Device was nullptr!");
+}
+
+Atlas::~Atlas()
+{
+	for (auto &page : pages)
+		safe_release(page.texture);
+}
+
+std::size_t Atlas::add_image(const std::uint32_t *pixels, long width, long height)
+{
+	Image &image = allocate(width, height);
+
+	D3DLOCKED_RECT locked_rect;
+	throw_if_failed(pages[image.page].texture->LockRect(0, &locked_rect, &image.rect, 0));
+
+	std::uint8_t *dst_row = static_cast<std::uint8_t *>(locked_rect.pBits);
+
+	for (long y = 0; y < height; ++y)
+	{
+		std::memcpy(dst_row, &pixels[width * y], width * sizeof(std::uint32_t));
+		dst_row += locked_rect.Pitch;
+	}
+
+	pages[image.page].texture->UnlockRect(0);
+
+	return std::size(images) - 1;
+}
+
+std::size_t Atlas::add_image(const std::string &file)
+{
+	D3DXIMAGE_INFO info;
+	throw_if_failed(D3DXGetImageInfoFromFileA(file.c_str(), &info));
+
+	Image &image = allocate(static_cast<long>(info.Width), static_cast<long>(info.Height));
+
+	IDirect3DSurface9 *surface = nullptr;
+	throw_if_failed(pages[image.page].texture->GetSurfaceLevel(0, &surface));
+
+	HRESULT hr = D3DXLoadSurfaceFromFileA(surface, nullptr, &image.rect, file.c_str(), nullptr, D3DX_FILTER_NONE, 0, nullptr);
+	safe_release(surface);
+	throw_if_failed(hr);
+
+	return std::size(images) - 1;
+}
+
+std::size_t Atlas::get_num_images() const
+{
+	return std::size(images);
+}
+
+IDirect3DTexture9 *Atlas::get_texture(std::size_t image) const
+{
+	return pages[images[image].page].texture;
+}
+
+const Vec4 &Atlas::get_tex_coords(std::size_t image) const
+{
+	return images[image].tex_coords;
+}
+
+Vec2 Atlas::get_size(std::size_t image) const
+{
+	const RECT &rect = images[image].rect;
+	return { static_cast<float>(rect.right - rect.left), static_cast<float>(rect.bottom - rect.top) };
+}
+
+std::size_t Atlas::get_num_pages() const
+{
+	return std::size(pages);
+}
+
+IDirect3DTexture9 *Atlas::get_page_texture(std::size_t page) const
+{
+	return pages[page].texture;
+}
+
+std::vector<AtlasPageStats> Atlas::get_stats() const
+{
+	std::vector<AtlasPageStats> stats;
+
+	for (const auto &page : pages)
+	{
+		float occupancy = static_cast<float>(page.used_area) / static_cast<float>(page.width * page.height);
+		stats.push_back(AtlasPageStats{ page.width, page.height, page.num_images, occupancy });
+	}
+
+	return stats;
+}
+
+Atlas::Image &Atlas::allocate(long width, long height)
+{
+	if (width <= 0 || height <= 0)
+		throw std::exception(fmt::format("Atlas::allocate: Bad image size ({}x{})!", width, height).c_str());
+
+	long padded_width = width + 2 * padding;
+	long padded_height = height + 2 * padding;
+
+	RECT rect;
+	std::size_t page = 0;
+
+	for (; page < std::size(pages); ++page)
+	{
+		if (insert(pages[page], padded_width, padded_height, &rect))
+			break;
+	}
+
+	if (page == std::size(pages))
+	{
+		Page &new_page = add_page(padded_width, padded_height);
+		insert(new_page, padded_width, padded_height, &rect);
+	}
+
+	const Page &target = pages[page];
+
+	rect = { rect.left + padding, rect.top + padding, rect.right - padding, rect.bottom - padding };
+
+	Vec4 tex_coords
+	{
+		static_cast<float>(rect.left)   / target.width,
+		static_cast<float>(rect.top)    / target.height,
+		static_cast<float>(rect.right)  / target.width,
+		static_cast<float>(rect.bottom) / target.height
+	};
+
+	images.push_back(Image{ page, rect, tex_coords });
+	return images.back();
+}
+
+bool Atlas::fit(const Page &page, std::size_t node, long width, long height, long *y) const
+{
+	long x = page.skyline[node].x;
+	if (x + width > page.width)
+		return false;
+
+	long top = 0;
+	long remaining = width;
+
+	for (std::size_t i = node; remaining > 0; ++i)
+	{
+		top = std::max(top, page.skyline[i].y);
+		if (top + height > page.height)
+			return false;
+
+		remaining -= page.skyline[i].width;
+	}
+
+	*y = top;
+	return true;
+}
+
+bool Atlas::insert(Page &page, long width, long height, RECT *rect)
+{
+	std::size_t best = std::size(page.skyline);
+	long best_y = 0;
+	long best_bottom = LONG_MAX;
+	long best_width = LONG_MAX;
+
+	for (std::size_t i = 0; i < std::size(page.skyline); ++i)
+	{
+		long y;
+		if (!fit(page, i, width, height, &y))
+			continue;
+
+		if (y + height < best_bottom || (y + height == best_bottom && page.skyline[i].width < best_width))
+		{
+			best = i;
+			best_y = y;
+			best_bottom = y + height;
+			best_width = page.skyline[i].width;
+		}
+	}
+
+	if (best == std::size(page.skyline))
+		return false;
+
+	long x = page.skyline[best].x;
+	page.skyline.insert(std::begin(page.skyline) + best, SkylineNode{ x, best_y + height, width });
+
+	// shrink or drop the nodes now covered by the new one
+	for (std::size_t i = best + 1; i < std::size(page.skyline);)
+	{
+		SkylineNode &node = page.skyline[i];
+		long shrink = x + width - node.x;
+
+		if (shrink <= 0)
+			break;
+
+		if (shrink < node.width)
+		{
+			node.x += shrink;
+			node.width -= shrink;
+			break;
+		}
+
+		page.skyline.erase(std::begin(page.skyline) + i);
+	}
+
+	for (std::size_t i = 0; i + 1 < std::size(page.skyline);)
+	{
+		if (page.skyline[i].y == page.skyline[i + 1].y)
+		{
+			page.skyline[i].width += page.skyline[i + 1].width;
+			page.skyline.erase(std::begin(page.skyline) + i + 1);
+		}
+		else
+		{
+			++i;
+		}
+	}
+
+	page.used_area += width * height;
+	page.num_images++;
+
+	*rect = { x, best_y, x + width, best_y + height };
+	return true;
+}
+
+Atlas::Page &Atlas::add_page(long min_width, long min_height)
+{
+	long width = page_size;
+	long height = page_size;
+
+	// oversized images get a page of their own
+	while (width < min_width)
+		width *= 2;
+
+	while (height < min_height)
+		height *= 2;
+
+	IDirect3DTexture9 *texture = nullptr;
+	throw_if_failed(device->CreateTexture(width, height, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &texture, nullptr));
+
+	D3DLOCKED_RECT locked_rect;
+	throw_if_failed(texture->LockRect(0, &locked_rect, nullptr, 0));
+	{
+		std::uint8_t *dst_row = static_cast<std::uint8_t *>(locked_rect.pBits);
+
+		for (long y = 0; y < height; ++y)
+		{
+			std::memset(dst_row, 0, width * sizeof(std::uint32_t));
+			dst_row += locked_rect.Pitch;
+		}
+	}
+	texture->UnlockRect(0);
+
+	pages.push_back(Page{ texture, width, height, { SkylineNode{ 0, 0, width } }, 0, 0 });
+	return pages.back();
+}
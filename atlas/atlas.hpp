@@ -0,0 +1,77 @@
+#pragma once
+
+#include <d3d9.h>
+
+#include <string>
+#include <vector>
+#include <climits>
+
+#include "renderer.hpp"
+
+struct AtlasPageStats
+{
+	long         width;
+	long         height;
+	std::size_t  num_images;
+	float        occupancy;
+};
+
+// Packs registered images into shared texture pages (skyline bottom-left), so images on the same page
+// batch together. Pages live in the managed pool and survive Renderer::release()/reacquire().
+class Atlas
+{
+public:
+	Atlas(IDirect3DDevice9 *device, long page_size = 1024);
+	~Atlas();
+
+	// pixels are tightly packed A8R8G8B8 rows
+	std::size_t add_image(const std::uint32_t *pixels, long width, long height);
+	std::size_t add_image(const std::string &file);
+
+	std::size_t get_num_images() const;
+
+	IDirect3DTexture9 *get_texture(std::size_t image) const;
+	const Vec4 &get_tex_coords(std::size_t image) const;
+	Vec2 get_size(std::size_t image) const;
+
+	std::size_t get_num_pages() const;
+	IDirect3DTexture9 *get_page_texture(std::size_t page) const;
+
+	std::vector<AtlasPageStats> get_stats() const;
+
+private:
+	struct SkylineNode
+	{
+		long x;
+		long y;
+		long width;
+	};
+
+	struct Page
+	{
+		IDirect3DTexture9         *texture;
+		long                       width;
+		long                       height;
+		std::vector<SkylineNode>   skyline;
+		long                       used_area;
+		std::size_t                num_images;
+	};
+
+	struct Image
+	{
+		std::size_t  page;
+		RECT         rect;
+		Vec4         tex_coords;
+	};
+
+	Image &allocate(long width, long height);
+	bool fit(const Page &page, std::size_t node, long width, long height, long *y) const;
+	bool insert(Page &page, long width, long height, RECT *rect);
+	Page &add_page(long min_width, long min_height);
+
+	IDirect3DDevice9     *device;
+	long                  page_size;
+
+	std::vector<Page>     pages;
+	std::vector<Image>    images;
+};
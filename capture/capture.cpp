@@ -0,0 +1,519 @@
+#include "capture.hpp"
+
+#include <windows.h>
+
+namespace /* anonymous namespace */
+{
+	template <typename Ty>
+	void put(std::vector<std::uint8_t> &buffer, const Ty &value)
+	{
+		const std::uint8_t *bytes = reinterpret_cast<const std::uint8_t *>(&value);
+		buffer.insert(std::end(buffer), bytes, bytes + sizeof(Ty));
+	}
+
+	std::uint32_t to_capture_layer(std::size_t layer_id)
+	{
+		return layer_id == no_layer ? capture_no_layer : static_cast<std::uint32_t>(layer_id);
+	}
+
+	std::size_t from_capture_layer(std::uint32_t layer_id)
+	{
+		return layer_id == capture_no_layer ? no_layer : layer_id;
+	}
+
+	// Renderer expands the vertices of every batch but draws only these topologies, anything else would shift
+	// the vertices of all later batches. D3DPT_FORCE_DWORD only separates strips and never holds vertices.
+	bool is_drawable(std::uint32_t topology, std::uint32_t count, bool command)
+	{
+		if (topology == quad_topology || topology == D3DPT_FORCE_DWORD)
+			return !command && (topology == quad_topology || count == 0);
+
+		return topology_order(static_cast<ToplogyType>(topology)) > 0;
+	}
+
+	// captures may be truncated or corrupt, every count is checked against the record before it is used
+	template <typename Ty>
+	void require(const std::uint8_t *data, const std::uint8_t *end, std::size_t count)
+	{
+		if (static_cast<std::size_t>(end - data) / sizeof(Ty) < count)
+			throw std::exception("CaptureReader: Record exceeds its size, the capture is corrupt!");
+	}
+
+	template <typename Ty>
+	const std::uint8_t *get(const std::uint8_t *data, const std::uint8_t *end, Ty *values, std::size_t count)
+	{
+		require<Ty>(data, end, count);
+
+		std::memcpy(values, data, sizeof(Ty) * count);
+		return data + sizeof(Ty) * count;
+	}
+
+	template <typename Ty>
+	const std::uint8_t *get(const std::uint8_t *data, const std::uint8_t *end, Ty &value)
+	{
+		return get(data, end, &value, 1);
+	}
+};
+
+CaptureWriter::CaptureWriter(const std::string &path) :
+	file(nullptr)
+{
+	if (fopen_s(&file, path.c_str(), "wb") != 0 || !file)
+		throw std::exception(fmt::format("CaptureWriter::ctor: Failed to open {}!", path).c_str());
+
+	// large buffer so a live session only pays for a memcpy per draw
+	std::setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+	CaptureHeader header{ capture_magic, capture_version };
+	std::fwrite(&header, sizeof(header), 1, file);
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	if (file)
+		std::fclose(file);
+}
+
+void CaptureWriter::name_texture(IDirect3DTexture9 *texture, const std::string &name)
+{
+	auto found = textures.find(texture);
+	if (found != std::end(textures) && found->second.second == name)
+		return;
+
+	std::uint32_t id = found != std::end(textures) ? found->second.first : static_cast<std::uint32_t>(std::size(textures) + 1);
+	textures[texture] = { id, name };
+
+	payload.clear();
+	put(payload, id);
+	put(payload, static_cast<std::uint32_t>(std::size(name)));
+	payload.insert(std::end(payload), std::begin(name), std::end(name));
+
+	write_record(CAPTURE_TEXTURE, payload);
+}
+
+void CaptureWriter::write_draw(std::span<const RenderListPtr> render_lists)
+{
+	// textures seen for the first time get their record before the draw referencing them
+	for (const auto &render_list : render_lists)
+	{
+		for (const auto &batch : render_list->batches)
+			get_texture_id(batch.texture);
+
+		for (const auto &command : render_list->commands)
+			get_texture_id(command.texture);
+	}
+
+	payload.clear();
+	put(payload, static_cast<std::uint32_t>(std::size(render_lists)));
+
+	for (const auto &render_list : render_lists)
+	{
+		const RenderList &list = *render_list;
+
+		put(payload, static_cast<std::uint32_t>(list.layered));
+		put(payload, static_cast<std::uint32_t>(std::size(list.vertices)));
+		put(payload, static_cast<std::uint32_t>(std::size(list.tex_coords)));
+		put(payload, static_cast<std::uint32_t>(std::size(list.batches)));
+		put(payload, static_cast<std::uint32_t>(std::size(list.commands)));
+		put(payload, static_cast<std::uint32_t>(std::size(list.quads)));
+
+		for (const auto &batch : list.batches)
+		{
+			put(payload, static_cast<std::uint32_t>(batch.count));
+			put(payload, static_cast<std::uint32_t>(batch.topology));
+			put(payload, get_texture_id(batch.texture));
+			put(payload, to_capture_layer(batch.layer_id));
+		}
+
+		for (const auto &command : list.commands)
+		{
+			put(payload, command.key);
+			put(payload, command.first);
+			put(payload, command.count);
+			put(payload, static_cast<std::uint32_t>(command.topology));
+			put(payload, get_texture_id(command.texture));
+			put(payload, to_capture_layer(command.layer_id));
+		}
+
+		const std::uint8_t *vertices = reinterpret_cast<const std::uint8_t *>(std::data(list.vertices));
+		payload.insert(std::end(payload), vertices, vertices + sizeof(CompactVertex) * std::size(list.vertices));
+
+		const std::uint8_t *tex_coords = reinterpret_cast<const std::uint8_t *>(std::data(list.tex_coords));
+		payload.insert(std::end(payload), tex_coords, tex_coords + sizeof(Vec2) * std::size(list.tex_coords));
+
+		const std::uint8_t *quads = reinterpret_cast<const std::uint8_t *>(std::data(list.quads));
+		payload.insert(std::end(payload), quads, quads + sizeof(QuadInstance) * std::size(list.quads));
+	}
+
+	write_record(CAPTURE_DRAW, payload);
+}
+
+void CaptureWriter::end_frame()
+{
+	payload.clear();
+	write_record(CAPTURE_FRAME, payload);
+}
+
+std::uint32_t CaptureWriter::get_texture_id(IDirect3DTexture9 *texture)
+{
+	if (!texture)
+		return 0;
+
+	auto found = textures.find(texture);
+	if (found != std::end(textures))
+		return found->second.first;
+
+	// unnamed texture, announce it so the id is known to the reader
+	std::vector<std::uint8_t> record;
+	std::uint32_t id = static_cast<std::uint32_t>(std::size(textures) + 1);
+	textures[texture] = { id, std::string{} };
+
+	put(record, id);
+	put(record, std::uint32_t{ 0 });
+
+	write_record(CAPTURE_TEXTURE, record);
+	return id;
+}
+
+void CaptureWriter::write_record(CaptureRecord type, const std::vector<std::uint8_t> &payload)
+{
+	CaptureRecordHeader header{ type, static_cast<std::uint32_t>(std::size(payload)) };
+
+	std::fwrite(&header, sizeof(header), 1, file);
+	std::fwrite(std::data(payload), 1, std::size(payload), file);
+}
+
+CaptureReader::CaptureReader(const std::string &path, TextureResolver resolver) :
+	file(INVALID_HANDLE_VALUE), mapping(nullptr), view(nullptr), size(0), resolver(std::move(resolver))
+{
+	// the destructor does not run for a throwing constructor, a bad file must not leak its handles
+	try
+	{
+		open(path);
+		index_records();
+	}
+	catch (...)
+	{
+		close();
+		throw;
+	}
+}
+
+CaptureReader::~CaptureReader()
+{
+	close();
+}
+
+void CaptureReader::open(const std::string &path)
+{
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::exception(fmt::format("CaptureReader::ctor: Failed to open {}!", path).c_str());
+
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	size = static_cast<std::size_t>(file_size.QuadPart);
+
+	if (size < sizeof(CaptureHeader))
+		throw std::exception(fmt::format("CaptureReader::ctor: {} is not a capture!", path).c_str());
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping)
+		view = static_cast<const std::uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+
+	if (!view)
+		throw std::exception(fmt::format("CaptureReader::ctor: Failed to map {}!", path).c_str());
+
+	const std::uint8_t *view_end = view + size;
+
+	CaptureHeader header;
+	get(view, view_end, header);
+
+	if (header.magic != capture_magic || header.version != capture_version)
+		throw std::exception(fmt::format("CaptureReader::ctor: Unsupported capture (magic: {:X}, version: {})!", header.magic, header.version).c_str());
+}
+
+void CaptureReader::index_records()
+{
+	const std::uint8_t *view_end = view + size;
+
+	// index frames and texture names once, frames are decoded on demand
+	std::size_t pos = sizeof(CaptureHeader);
+	std::size_t frame_begin = pos;
+	bool frame_has_draws = false;
+
+	while (size - pos >= sizeof(CaptureRecordHeader))
+	{
+		CaptureRecordHeader record;
+		get(view + pos, view_end, record);
+
+		std::size_t payload = pos + sizeof(CaptureRecordHeader);
+		if (record.size > size - payload)
+			break; // truncated by a crashed session, keep what is complete
+
+		const std::uint8_t *data = view + payload;
+		const std::uint8_t *end = data + record.size;
+
+		if (record.type == CAPTURE_TEXTURE)
+		{
+			std::uint32_t id, length;
+			data = get(get(data, end, id), end, length);
+
+			require<char>(data, end, length);
+
+			std::string &name = texture_names[id];
+			name.resize(length);
+			get(data, end, std::data(name), length);
+		}
+		else if (record.type == CAPTURE_DRAW)
+		{
+			frame_has_draws = true;
+		}
+		else if (record.type == CAPTURE_FRAME)
+		{
+			frames.push_back(Frame{ frame_begin, pos });
+			frame_begin = payload + record.size;
+			frame_has_draws = false;
+		}
+
+		pos = payload + record.size;
+	}
+
+	// draws of a session that ended without a last end() still form a frame
+	if (frame_has_draws)
+		frames.push_back(Frame{ frame_begin, pos });
+}
+
+void CaptureReader::close()
+{
+	if (view)
+		UnmapViewOfFile(view);
+
+	if (mapping)
+		CloseHandle(mapping);
+
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+
+	view = nullptr;
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+}
+
+std::size_t CaptureReader::get_num_frames() const
+{
+	return std::size(frames);
+}
+
+void CaptureReader::read_frame(std::size_t frame, std::vector<std::vector<RenderListPtr>> &draws)
+{
+	if (frame >= std::size(frames))
+		throw std::exception(fmt::format("CaptureReader::read_frame: Bad frame index (index: {})!", frame).c_str());
+
+	std::size_t num_draws = 0;
+
+	for (std::size_t pos = frames[frame].begin; pos < frames[frame].end;)
+	{
+		CaptureRecordHeader record;
+		const std::uint8_t *data = get(view + pos, view + size, record);
+		const std::uint8_t *end = data + record.size;
+
+		pos += sizeof(CaptureRecordHeader) + record.size;
+
+		if (record.type != CAPTURE_DRAW)
+			continue;
+
+		if (std::size(draws) <= num_draws)
+			draws.emplace_back();
+
+		std::vector<RenderListPtr> &render_lists = draws[num_draws++];
+
+		std::uint32_t num_lists;
+		data = get(data, end, num_lists);
+
+		// every list takes at least its six counts
+		if (num_lists > static_cast<std::size_t>(end - data) / (6 * sizeof(std::uint32_t)))
+			throw std::exception(fmt::format("CaptureReader::read_frame: Bad list count ({}) in frame {}!", num_lists, frame).c_str());
+
+		render_lists.resize(num_lists);
+
+		for (auto &render_list : render_lists)
+		{
+			if (!render_list)
+				render_list = std::make_shared<RenderList>(0);
+
+			data = read_list(data, end, *render_list);
+		}
+	}
+
+	draws.resize(num_draws);
+}
+
+IDirect3DTexture9 *CaptureReader::resolve(std::uint32_t id)
+{
+	if (id == 0 || !resolver)
+		return nullptr;
+
+	auto found = resolved.find(id);
+	if (found != std::end(resolved))
+		return found->second;
+
+	IDirect3DTexture9 *texture = resolver(texture_names[id]);
+	resolved[id] = texture;
+
+	return texture;
+}
+
+const std::uint8_t *CaptureReader::read_list(const std::uint8_t *data, const std::uint8_t *end, RenderList &render_list)
+{
+	std::uint32_t layered, num_vertices, num_tex_coords, num_batches, num_commands, num_quads;
+
+	data = get(data, end, layered);
+	data = get(data, end, num_vertices);
+	data = get(data, end, num_tex_coords);
+	data = get(data, end, num_batches);
+	data = get(data, end, num_commands);
+	data = get(data, end, num_quads);
+
+	render_list.clear();
+	render_list.layered = layered != 0;
+
+	data = read_batches(data, end, num_batches, num_commands, render_list);
+
+	// the draw paths index vertices, tex coords and quads through batches and commands, which must cover them exactly
+	std::uint64_t batch_vertices = 0, batch_tex_coords = 0, batch_quads = 0, command_tex_coords = 0;
+
+	for (std::size_t i = 0; i < std::size(render_list.batches); ++i)
+	{
+		const Batch &batch = render_list.batches[i];
+
+		if (batch.topology == quad_topology)
+		{
+			batch_quads += batch.count;
+			continue;
+		}
+
+		batch_vertices += batch.count;
+		if (batch_textured[i])
+			batch_tex_coords += batch.count;
+	}
+
+	for (std::size_t i = 0; i < std::size(render_list.commands); ++i)
+	{
+		const RenderList::Command &command = render_list.commands[i];
+
+		if (static_cast<std::uint64_t>(command.first) + command.count > num_vertices)
+			throw std::exception(fmt::format("CaptureReader::read_list: Command {} exceeds the {} vertices of its list!", i, num_vertices).c_str());
+
+		if (command_textured[i])
+			command_tex_coords += command.count;
+	}
+
+	bool consistent = render_list.layered ?
+		command_tex_coords == num_tex_coords && num_quads == 0 :
+		batch_vertices == num_vertices && batch_tex_coords == num_tex_coords && batch_quads == num_quads;
+
+	if (!consistent)
+		throw std::exception("CaptureReader::read_list: Batches and commands do not match the recorded geometry!");
+
+	require<CompactVertex>(data, end, num_vertices);
+	render_list.vertices.resize(num_vertices);
+	data = get(data, end, std::data(render_list.vertices), num_vertices);
+
+	require<Vec2>(data, end, num_tex_coords);
+	tex_scratch.resize(num_tex_coords);
+	data = get(data, end, std::data(tex_scratch), num_tex_coords);
+
+	assign_tex_coords(render_list);
+
+	require<QuadInstance>(data, end, num_quads);
+	render_list.quads.resize(num_quads);
+	return get(data, end, std::data(render_list.quads), num_quads);
+}
+
+const std::uint8_t *CaptureReader::read_batches(const std::uint8_t *data, const std::uint8_t *end, std::uint32_t num_batches, std::uint32_t num_commands, RenderList &render_list)
+{
+	batch_textured.clear();
+	command_textured.clear();
+
+	for (std::uint32_t i = 0; i < num_batches; ++i)
+	{
+		std::uint32_t count, topology, texture, layer_id;
+
+		data = get(data, end, count);
+		data = get(data, end, topology);
+		data = get(data, end, texture);
+		data = get(data, end, layer_id);
+
+		if (!is_drawable(topology, count, false))
+			throw std::exception(fmt::format("CaptureReader::read_batches: Bad batch topology ({}) for {} elements!", topology, count).c_str());
+
+		render_list.batches.emplace_back(count, static_cast<ToplogyType>(topology), resolve(texture), from_capture_layer(layer_id));
+		batch_textured.push_back(texture != 0 || layer_id != capture_no_layer);
+	}
+
+	for (std::uint32_t i = 0; i < num_commands; ++i)
+	{
+		RenderList::Command command;
+		std::uint32_t topology, texture, layer_id;
+
+		data = get(data, end, command.key);
+		data = get(data, end, command.first);
+		data = get(data, end, command.count);
+		data = get(data, end, topology);
+		data = get(data, end, texture);
+		data = get(data, end, layer_id);
+
+		if (!is_drawable(topology, command.count, true))
+			throw std::exception(fmt::format("CaptureReader::read_batches: Bad command topology ({}) for {} vertices!", topology, command.count).c_str());
+
+		command.tex_first = 0;
+		command.topology = static_cast<ToplogyType>(topology);
+		command.texture = resolve(texture);
+		command.layer_id = from_capture_layer(layer_id);
+
+		render_list.commands.push_back(command);
+		command_textured.push_back(texture != 0 || layer_id != capture_no_layer);
+	}
+
+	return data;
+}
+
+void CaptureReader::assign_tex_coords(RenderList &render_list)
+{
+	// tex_scratch holds the tex coords of every range recorded as textured in append order, only ranges that
+	// are still textured after resolving keep theirs. Layered lists are drawn through their commands, other lists through batches.
+	std::size_t src = 0;
+
+	if (render_list.layered)
+	{
+		for (std::size_t i = 0; i < std::size(render_list.commands); ++i)
+		{
+			RenderList::Command &command = render_list.commands[i];
+			if (!command_textured[i])
+				continue;
+
+			if (command.is_textured())
+			{
+				command.tex_first = static_cast<std::uint32_t>(std::size(render_list.tex_coords));
+				render_list.tex_coords.insert(std::end(render_list.tex_coords), std::begin(tex_scratch) + src, std::begin(tex_scratch) + src + command.count);
+			}
+
+			src += command.count;
+		}
+
+		return;
+	}
+
+	for (std::size_t i = 0; i < std::size(render_list.batches); ++i)
+	{
+		const Batch &batch = render_list.batches[i];
+		if (!batch_textured[i] || batch.topology == quad_topology)
+			continue;
+
+		if (batch.is_textured())
+			render_list.tex_coords.insert(std::end(render_list.tex_coords), std::begin(tex_scratch) + src, std::begin(tex_scratch) + src + batch.count);
+
+		src += batch.count;
+	}
+}
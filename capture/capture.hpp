@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+#include "renderer.hpp"
+
+// File layout: CaptureHeader followed by records, each a CaptureRecordHeader and its payload.
+//
+//   CAPTURE_TEXTURE  u32 id, u32 name length, name
+//   CAPTURE_DRAW     u32 list count, per list:
+//                      u32 layered, u32 vertex count, u32 tex coord count, u32 batch count, u32 command count,
+//                      u32 quad count,
+//                      batches    { u32 count, u32 topology, u32 texture id, u32 layer }, none for layered lists
+//                      commands   { u64 key, u32 first, u32 count, u32 topology, u32 texture id, u32 layer }
+//                      vertices   (raw CompactVertex)
+//                      tex coords (raw Vec2, for the vertices of textured appends, in append order)
+//                      quads      (raw QuadInstance)
+//   CAPTURE_FRAME    empty, ends the current frame
+//
+// Texture id 0 is nullptr. One CAPTURE_DRAW record is written per Renderer::draw call. Draws after the
+// last CAPTURE_FRAME, left by a session that ended mid frame, are read as one more frame. Layers are stored
+// by handle (capture_no_layer for none) and resolve against the layers of whichever Renderer draws the replay.
+
+constexpr std::uint32_t capture_magic   = 0x50434c52; // "RLCP"
+constexpr std::uint32_t capture_version = 1;
+constexpr std::uint32_t capture_no_layer = 0xffffffff;
+
+enum CaptureRecord : std::uint32_t
+{
+	CAPTURE_TEXTURE = 1,
+	CAPTURE_DRAW    = 2,
+	CAPTURE_FRAME   = 3
+};
+
+struct CaptureHeader
+{
+	std::uint32_t magic;
+	std::uint32_t version;
+};
+
+struct CaptureRecordHeader
+{
+	std::uint32_t type;
+	std::uint32_t size;
+};
+
+class CaptureWriter
+{
+public:
+	explicit CaptureWriter(const std::string &path);
+	~CaptureWriter();
+
+	// names let a replay map texture ids back to its own textures
+	void name_texture(IDirect3DTexture9 *texture, const std::string &name);
+
+	void write_draw(std::span<const RenderListPtr> render_lists);
+	void end_frame();
+
+private:
+	std::uint32_t get_texture_id(IDirect3DTexture9 *texture);
+	void write_record(CaptureRecord type, const std::vector<std::uint8_t> &payload);
+
+	std::FILE                                                              *file;
+	std::vector<std::uint8_t>                                               payload;
+	std::unordered_map<IDirect3DTexture9 *, std::pair<std::uint32_t, std::string>> textures;
+};
+
+class CaptureReader
+{
+public:
+	// maps a recorded texture name to a texture of the replaying process, may return nullptr
+	using TextureResolver = std::function<IDirect3DTexture9 *(const std::string &name)>;
+
+	explicit CaptureReader(const std::string &path, TextureResolver resolver = nullptr);
+	~CaptureReader();
+
+	std::size_t get_num_frames() const;
+
+	// Rebuilds the draw calls of a frame, draws[i] holds the lists of the i-th Renderer::draw call.
+	// Lists already in draws are cleared and reused. Throws if a record does not match its own counts.
+	void read_frame(std::size_t frame, std::vector<std::vector<RenderListPtr>> &draws);
+
+private:
+	struct Frame
+	{
+		std::size_t begin;
+		std::size_t end;
+	};
+
+	void open(const std::string &path);
+	void index_records();
+	void close();
+
+	IDirect3DTexture9 *resolve(std::uint32_t id);
+	const std::uint8_t *read_list(const std::uint8_t *data, const std::uint8_t *end, RenderList &render_list);
+	const std::uint8_t *read_batches(const std::uint8_t *data, const std::uint8_t *end, std::uint32_t num_batches, std::uint32_t num_commands, RenderList &render_list);
+	void assign_tex_coords(RenderList &render_list);
+
+	HANDLE                                              file;
+	HANDLE                                              mapping;
+	const std::uint8_t                                 *view;
+	std::size_t                                         size;
+
+	TextureResolver                                     resolver;
+
+	std::vector<Frame>                                  frames;
+	std::unordered_map<std::uint32_t, std::string>      texture_names;
+	std::unordered_map<std::uint32_t, IDirect3DTexture9 *> resolved;
+	std::vector<bool>                                   batch_textured;
+	std::vector<bool>                                   command_textured;
+	std::vector<Vec2>                                   tex_scratch;
+};
@@ -0,0 +1,95 @@
+// Replays a capture written by CaptureWriter on the software rasterizer and reports per-frame timings,
+// so batching changes can be compared on recorded workloads without a device. The pixels of recorded
+// textures are not part of a capture, every named texture replays as opaque white.
+//
+//   replay <capture> [width] [height] [repetitions]
+
+#include <chrono>
+#include <iostream>
+
+#include "capture.hpp"
+#include "rasterizer.hpp"
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		std::cerr << "usage: replay <capture> [width] [height] [repetitions]" << std::endl;
+		std::cerr << "textures are replayed as opaque white, only their names are captured" << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		long width = argc > 2 ? std::stol(argv[2]) : 1920;
+		long height = argc > 3 ? std::stol(argv[3]) : 1080;
+		int repetitions = argc > 4 ? std::stoi(argv[4]) : 10;
+
+		if (width <= 0 || height <= 0)
+			throw std::exception(fmt::format("replay: Bad target size {}x{}!", width, height).c_str());
+
+		if (repetitions <= 0)
+			throw std::exception(fmt::format("replay: Bad repetition count ({})!", repetitions).c_str());
+
+		SoftwareRasterizer rasterizer(width, height);
+
+		// each name gets its own unbound texture, which the rasterizer samples as white, so textured
+		// batches keep their tex coords and batch breaks
+		std::uintptr_t num_textures = 0;
+
+		CaptureReader reader(argv[1], [&](const std::string &)
+		{
+			return reinterpret_cast<IDirect3DTexture9 *>(++num_textures);
+		});
+
+		std::vector<std::vector<RenderListPtr>> draws;
+		double total_ms = 0.0;
+
+		for (std::size_t frame = 0; frame < reader.get_num_frames(); ++frame)
+		{
+			reader.read_frame(frame, draws);
+
+			std::size_t num_lists = 0, num_vertices = 0, num_quads = 0, num_batches = 0;
+
+			for (const auto &render_lists : draws)
+			{
+				for (const auto &render_list : render_lists)
+				{
+					num_lists++;
+					num_vertices += render_list->get_num_vertices();
+					num_quads += render_list->get_num_quads();
+					num_batches += render_list->get_num_batches();
+				}
+			}
+
+			auto start = std::chrono::steady_clock::now();
+
+			for (int i = 0; i < repetitions; ++i)
+			{
+				rasterizer.clear();
+
+				for (const auto &render_lists : draws)
+				{
+					for (const auto &render_list : render_lists)
+						rasterizer.draw(render_list);
+				}
+			}
+
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / repetitions;
+			total_ms += ms;
+
+			std::cout << fmt::format("frame {:>5}: {:>3} draws {:>4} lists {:>8} vertices {:>7} quads {:>6} batches {:>8.3f} ms",
+				frame, std::size(draws), num_lists, num_vertices, num_quads, num_batches, ms) << std::endl;
+		}
+
+		if (reader.get_num_frames() > 0)
+			std::cout << fmt::format("{} frames, {:.3f} ms average", reader.get_num_frames(), total_ms / reader.get_num_frames()) << std::endl;
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -278,43 +278,37 @@ void Font::draw_text(const RenderListPtr &render_list, Vec2 pos, const std::stri
 
 		if (c != ' ')
 		{
-			Vertex v[] =
-			{
-				{ Vec4{ pos.x - 0.5f,     pos.y - 0.5f + h, 0.9f, 1.f }, color, Vec2{ tx1, ty2 } },
-				{ Vec4{ pos.x - 0.5f,     pos.y - 0.5f,     0.9f, 1.f }, color, Vec2{ tx1, ty1 } },
-				{ Vec4{ pos.x - 0.5f + w, pos.y - 0.5f + h, 0.9f, 1.f }, color, Vec2{ tx2, ty2 } },
-
-				{ Vec4{ pos.x - 0.5f + w, pos.y - 0.5f,     0.9f, 1.f }, color, Vec2{ tx2, ty1 } },
-				{ Vec4{ pos.x - 0.5f + w, pos.y - 0.5f + h, 0.9f, 1.f }, color, Vec2{ tx2, ty2 } },
-				{ Vec4{ pos.x - 0.5f,     pos.y - 0.5f,     0.9f, 1.f }, color, Vec2{ tx1, ty1 } }
-			};
+			QuadInstance quad{ Vec4{ pos.x - 0.5f, pos.y - 0.5f, w, h }, Vec4{ tx1, ty1, tx2, ty2 }, color };
 
 			if (flags & TEXT_SHADOW)
 			{
 				Color shadow_color = D3DCOLOR_ARGB((color >> 24) & 0xff, 0x00, 0x00, 0x00);
 
-				for (auto &vtx : v) { vtx.color = shadow_color; vtx.position.x += 1.f; }
-				renderer->add_vertices(render_list, v, D3DPT_TRIANGLELIST, texture);
+				QuadInstance shadow[] { quad, quad, quad, quad };
+				shadow[0].rect.x += 1.f;
+				shadow[1].rect.x -= 1.f;
+				shadow[2].rect.y += 1.f;
+				shadow[3].rect.y -= 1.f;
 
-				for (auto &vtx : v) { vtx.position.x -= 2.f; }
-				renderer->add_vertices(render_list, v, D3DPT_TRIANGLELIST, texture);
+				for (auto &q : shadow) { q.color = shadow_color; }
+				renderer->add_quads(render_list, shadow, texture);
 
-				for (auto &vtx : v) { vtx.position.x += 1.f; vtx.position.y += 1.f; }
-				renderer->add_vertices(render_list, v, D3DPT_TRIANGLELIST, texture);
-
-				for (auto &vtx : v) { vtx.position.y -= 2.f; }
-				renderer->add_vertices(render_list, v, D3DPT_TRIANGLELIST, texture);
-		
-				for (auto &vtx : v) { vtx.color = color; vtx.position.y -= 1.f; }
+				// the glyph sits two pixels above its shadow, as it always has
+				quad.rect.y -= 2.f;
 			}
 
-			renderer->add_vertices(render_list, v, D3DPT_TRIANGLELIST, texture);
+			renderer->add_quads(render_list, { &quad, 1 }, texture);
 		}
 
 		pos.x += w - (2.f * spacing);
 	}
 }
 
+IDirect3DTexture9 *Font::get_texture() const
+{
+	return texture;
+}
+
 std::shared_ptr<Font> Font::make_ptr()
 {
 	return shared_from_this();
@@ -38,6 +38,7 @@ public:
 	
 	void draw_text(const RenderListPtr &render_list, Vec2 position, const std::string &text, Color color = 0xffffffff, std::uint8_t flags = TEXT_LEFT);
 	Vec2 get_text_extent(const std::string &text);
+	IDirect3DTexture9 *get_texture() const;
 
 	std::shared_ptr<Font> make_ptr();
 
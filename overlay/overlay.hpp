@@ -0,0 +1,91 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include "renderer.hpp"
+
+// A vertex policy fixes the vertex layout, its FVF and the batch key of an OverlayRenderer at compile time.
+// Only colour vertices are supported, textured draws go through Renderer.
+struct ColorVertexPolicy
+{
+	struct vertex_type
+	{
+		float x, y, z, rhw;
+		Color color;
+	};
+
+	struct batch_key
+	{
+		ToplogyType topology;
+
+		bool operator==(const batch_key &) const = default;
+	};
+
+	static constexpr unsigned long fvf = D3DFVF_XYZRHW | D3DFVF_DIFFUSE;
+
+	static vertex_type make_vertex(float x, float y, Color color);
+	static batch_key make_key(ToplogyType topology);
+};
+
+// Lean immediate renderer for overlays that need none of Renderer's features (render lists, fonts,
+// layers, instancing). Topologies are template arguments, so joining and primitive counts are resolved
+// at compile time, and the vertex size is whatever the policy needs: 20 bytes for DebugOverlay.
+// draw() applies Renderer's render states (record_render_states) and restores the previous ones, no
+// begin()/end() is needed.
+template <typename VertexPolicy>
+class OverlayRenderer
+{
+public:
+	using vertex_type = typename VertexPolicy::vertex_type;
+	using batch_key = typename VertexPolicy::batch_key;
+
+	OverlayRenderer(IDirect3DDevice9 *device, std::size_t max_vertices);
+	~OverlayRenderer();
+
+	void reacquire();
+	void release();
+
+	// The span is invalidated by the next append.
+	template <ToplogyType Topology>
+	std::span<vertex_type> reserve_vertices(std::size_t count);
+
+	void draw_filled_rect(const Vec4 &rect, Color color);
+	void draw_rect(const Vec4 &rect, float stroke_width, Color color);
+	void draw_line(const Vec2 &from, const Vec2 &to, Color color);
+
+	// Draws and discards everything appended since the last draw().
+	void draw();
+
+	std::size_t get_num_vertices() const;
+	std::size_t get_num_batches() const;
+
+private:
+	struct Batch
+	{
+		batch_key key;
+		std::size_t count;
+	};
+
+	template <ToplogyType Topology>
+	std::span<vertex_type> append(std::size_t count, const batch_key &key);
+
+	void create_vertex_buffer();
+	IDirect3DStateBlock9 *record_state_block();
+
+	IDirect3DDevice9        *device;
+	IDirect3DVertexBuffer9  *vertex_buffer;
+	IDirect3DStateBlock9    *prev_state_block;
+	IDirect3DStateBlock9    *render_state_block;
+
+	std::size_t             max_vertices;
+
+	std::vector<vertex_type> vertices;
+	std::vector<Batch>      batches;
+};
+
+using DebugOverlay = OverlayRenderer<ColorVertexPolicy>;
+
+static_assert(sizeof(ColorVertexPolicy::vertex_type) == 20, "ColorVertexPolicy::vertex_type does not match its FVF!");
+
+#include "overlay.inl"
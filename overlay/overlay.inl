@@ -0,0 +1,175 @@
+#pragma once
+
+inline ColorVertexPolicy::vertex_type ColorVertexPolicy::make_vertex(float x, float y, Color color)
+{
+	return vertex_type{ x, y, 1.f, 1.f, color };
+}
+
+inline ColorVertexPolicy::batch_key ColorVertexPolicy::make_key(ToplogyType topology)
+{
+	return batch_key{ topology };
+}
+
+template <typename VertexPolicy>
+OverlayRenderer<VertexPolicy>::OverlayRenderer(IDirect3DDevice9 *device, std::size_t max_vertices) :
+	device(device), vertex_buffer(nullptr), prev_state_block(nullptr), render_state_block(nullptr), max_vertices(max_vertices)
+{
+	if (!device)
+		throw std::exception("OverlayRenderer::ctor: Device was nullptr!");
+
+	vertices.reserve(max_vertices);
+	reacquire();
+}
+
+template <typename VertexPolicy>
+OverlayRenderer<VertexPolicy>::~OverlayRenderer()
+{
+	release();
+}
+
+template <typename VertexPolicy>
+void OverlayRenderer<VertexPolicy>::reacquire()
+{
+	create_vertex_buffer();
+
+	render_state_block = record_state_block();
+	prev_state_block = record_state_block();
+}
+
+template <typename VertexPolicy>
+void OverlayRenderer<VertexPolicy>::release()
+{
+	safe_release(vertex_buffer);
+	safe_release(prev_state_block);
+	safe_release(render_state_block);
+}
+
+template <typename VertexPolicy>
+template <ToplogyType Topology>
+std::span<typename OverlayRenderer<VertexPolicy>::vertex_type> OverlayRenderer<VertexPolicy>::reserve_vertices(std::size_t count)
+{
+	return append<Topology>(count, VertexPolicy::make_key(Topology));
+}
+
+template <typename VertexPolicy>
+void OverlayRenderer<VertexPolicy>::draw_filled_rect(const Vec4 &rect, Color color)
+{
+	std::span<vertex_type> v = reserve_vertices<D3DPT_TRIANGLELIST>(6);
+
+	v[0] = VertexPolicy::make_vertex(rect.x,          rect.y,          color);
+	v[1] = VertexPolicy::make_vertex(rect.x + rect.z, rect.y,          color);
+	v[2] = VertexPolicy::make_vertex(rect.x,          rect.y + rect.w, color);
+
+	v[3] = VertexPolicy::make_vertex(rect.x + rect.z, rect.y,          color);
+	v[4] = VertexPolicy::make_vertex(rect.x + rect.z, rect.y + rect.w, color);
+	v[5] = VertexPolicy::make_vertex(rect.x,          rect.y + rect.w, color);
+}
+
+template <typename VertexPolicy>
+void OverlayRenderer<VertexPolicy>::draw_rect(const Vec4 &rect, float stroke_width, Color color)
+{
+	for (const auto &edge : get_rect_edges(rect, stroke_width))
+		draw_filled_rect(edge, color);
+}
+
+template <typename VertexPolicy>
+void OverlayRenderer<VertexPolicy>::draw_line(const Vec2 &from, const Vec2 &to, Color color)
+{
+	std::span<vertex_type> v = reserve_vertices<D3DPT_LINELIST>(2);
+
+	v[0] = VertexPolicy::make_vertex(from.x, from.y, color);
+	v[1] = VertexPolicy::make_vertex(to.x, to.y, color);
+}
+
+template <typename VertexPolicy>
+void OverlayRenderer<VertexPolicy>::draw()
+{
+	if (std::empty(batches))
+		return;
+
+	if (std::size(vertices) > max_vertices)
+	{
+		max_vertices = std::size(vertices);
+
+		safe_release(vertex_buffer);
+		create_vertex_buffer();
+	}
+
+	void *data;
+
+	throw_if_failed(vertex_buffer->Lock(0, 0, &data, D3DLOCK_DISCARD));
+	std::memcpy(data, std::data(vertices), sizeof(vertex_type) * std::size(vertices));
+	vertex_buffer->Unlock();
+
+	prev_state_block->Capture();
+	render_state_block->Apply();
+
+	device->SetStreamSource(0, vertex_buffer, 0, sizeof(vertex_type));
+
+	std::size_t start = 0;
+
+	for (const auto &batch : batches)
+	{
+		// a strip shorter than one primitive is skipped, as in Renderer::draw_batch
+		std::uint32_t primitive_count = get_primitive_count(batch.key.topology, batch.count);
+
+		if (primitive_count > 0)
+			device->DrawPrimitive(batch.key.topology, static_cast<UINT>(start), primitive_count);
+
+		start += batch.count;
+	}
+
+	prev_state_block->Apply();
+
+	vertices.clear();
+	batches.clear();
+}
+
+template <typename VertexPolicy>
+std::size_t OverlayRenderer<VertexPolicy>::get_num_vertices() const
+{
+	return std::size(vertices);
+}
+
+template <typename VertexPolicy>
+std::size_t OverlayRenderer<VertexPolicy>::get_num_batches() const
+{
+	return std::size(batches);
+}
+
+template <typename VertexPolicy>
+template <ToplogyType Topology>
+std::span<typename OverlayRenderer<VertexPolicy>::vertex_type> OverlayRenderer<VertexPolicy>::append(std::size_t count, const batch_key &key)
+{
+	static_assert(topology_order(Topology) > 0, "OverlayRenderer::append: Topology is never drawn!");
+
+	std::size_t first = std::size(vertices);
+	vertices.resize(first + count);
+
+	// only list topologies can be joined, strips must keep their own draw call
+	if constexpr (get_topology_info(Topology).list)
+	{
+		if (!std::empty(batches) && batches.back().key == key)
+		{
+			batches.back().count += count;
+			return { std::data(vertices) + first, count };
+		}
+	}
+
+	batches.push_back(Batch{ key, count });
+	return { std::data(vertices) + first, count };
+}
+
+template <typename VertexPolicy>
+void OverlayRenderer<VertexPolicy>::create_vertex_buffer()
+{
+	throw_if_failed(device->CreateVertexBuffer(max_vertices * sizeof(vertex_type), D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY,
+		VertexPolicy::fvf, D3DPOOL_DEFAULT, &vertex_buffer, nullptr));
+}
+
+template <typename VertexPolicy>
+IDirect3DStateBlock9 *OverlayRenderer<VertexPolicy>::record_state_block()
+{
+	// the stream is set in draw(), the buffer is recreated when it grows
+	return record_render_states(device, VertexPolicy::fvf, nullptr, 0);
+}
@@ -0,0 +1,794 @@
+#include "rasterizer.hpp"
+
+#include <emmintrin.h>
+
+ThreadPool::ThreadPool(std::size_t num_threads) :
+	job(nullptr), count(0), next(0), active(0), generation(0), stop(false)
+{
+	// the calling thread takes part in every run()
+	for (std::size_t i = 1; i < num_threads; ++i)
+		threads.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+
+	wake.notify_all();
+
+	for (auto &thread : threads)
+		thread.join();
+}
+
+void ThreadPool::run(std::size_t count, const std::function<void(std::size_t)> &job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		this->job = &job;
+		this->count = count;
+		next = 0;
+		active = std::size(threads);
+		generation++;
+	}
+
+	wake.notify_all();
+	drain();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return active == 0; });
+
+	this->job = nullptr;
+}
+
+void ThreadPool::work()
+{
+	std::uint64_t seen = 0;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stop || generation != seen; });
+
+			if (stop)
+				return;
+
+			seen = generation;
+		}
+
+		drain();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--active == 0)
+			done.notify_one();
+	}
+}
+
+void ThreadPool::drain()
+{
+	for (std::size_t i = next++; i < count; i = next++)
+		(*job)(i);
+}
+
+SoftwareRasterizer::SoftwareRasterizer(long width, long height, std::size_t num_threads) :
+	width(width), height(height), pitch((width + 3) & ~3L), tiles_x((width + tile_size - 1) / tile_size),
+	tiles_y((height + tile_size - 1) / tile_size), separate_alpha(false), pool(num_threads ? num_threads : 1)
+{
+	if (width <= 0 || height <= 0)
+		throw std::exception(fmt::format("SoftwareRasterizer::ctor: Bad size ({}x{})!", width, height).c_str());
+
+	// rows are padded to four pixels so SSE groups never straddle a row end
+	pixels.resize(pitch * height);
+	bins.resize(tiles_x * tiles_y);
+}
+
+void SoftwareRasterizer::bind_texture(IDirect3DTexture9 *texture, const std::uint32_t *pixels, long width, long height)
+{
+	textures[texture] = Texture{ { pixels, pixels + width * height }, width, height, false };
+}
+
+void SoftwareRasterizer::unbind_texture(IDirect3DTexture9 *texture)
+{
+	textures.erase(texture);
+}
+
+void SoftwareRasterizer::bind_layer(LayerHandle layer, const std::uint32_t *pixels, long width, long height, long pitch)
+{
+	if (pitch < width)
+		throw std::exception(fmt::format("SoftwareRasterizer::bind_layer: Pitch {} is less than the width {}!", pitch, width).c_str());
+
+	Texture texture{ std::vector<std::uint32_t>(width * height), width, height, true };
+
+	for (long y = 0; y < height; ++y)
+		std::copy_n(pixels + y * pitch, width, std::data(texture.pixels) + y * width);
+
+	layers[layer.id] = std::move(texture);
+}
+
+void SoftwareRasterizer::unbind_layer(LayerHandle layer)
+{
+	layers.erase(layer.id);
+}
+
+void SoftwareRasterizer::set_separate_alpha(bool enable)
+{
+	separate_alpha = enable;
+}
+
+void SoftwareRasterizer::clear(Color color)
+{
+	std::fill(std::begin(pixels), std::end(pixels), color);
+}
+
+void SoftwareRasterizer::draw(const RenderListPtr &render_list)
+{
+	setup(*render_list);
+	bin();
+
+	pool.run(std::size(bins), [this](std::size_t tile) { rasterize_tile(tile); });
+}
+
+long SoftwareRasterizer::get_width() const
+{
+	return width;
+}
+
+long SoftwareRasterizer::get_height() const
+{
+	return height;
+}
+
+long SoftwareRasterizer::get_pitch() const
+{
+	return pitch;
+}
+
+const std::vector<std::uint32_t> &SoftwareRasterizer::get_pixels() const
+{
+	return pixels;
+}
+
+void SoftwareRasterizer::setup(const RenderList &render_list)
+{
+	struct Range
+	{
+		std::size_t first;
+		std::size_t tex_first;
+		std::size_t count;
+		ToplogyType topology;
+		IDirect3DTexture9 *texture;
+		std::size_t layer_id;
+		bool textured;
+	};
+
+	std::vector<Range> ranges;
+
+	if (render_list.layered)
+	{
+		render_list.sort_commands(sorted_commands, sort_scratch);
+
+		for (const auto &entry : sorted_commands)
+		{
+			const RenderList::Command &command = render_list.commands[entry.index];
+			ranges.push_back(Range{ command.first, command.tex_first, command.count, command.topology, command.texture, command.layer_id, command.is_textured() });
+		}
+	}
+	else
+	{
+		std::size_t pos = 0;
+		std::size_t tex_pos = 0;
+		std::size_t quad_pos = 0;
+
+		for (const auto &batch : render_list.batches)
+		{
+			if (!batch.count)
+				continue;
+
+			if (batch.topology == quad_topology)
+			{
+				ranges.push_back(Range{ quad_pos, 0, batch.count, batch.topology, batch.texture, batch.layer_id, batch.is_textured() });
+				quad_pos += batch.count;
+				continue;
+			}
+
+			if (topology_order(batch.topology) > 0)
+				ranges.push_back(Range{ pos, tex_pos, batch.count, batch.topology, batch.texture, batch.layer_id, batch.is_textured() });
+
+			pos += batch.count;
+			if (batch.is_textured())
+				tex_pos += batch.count;
+		}
+	}
+
+	primitives.clear();
+
+	for (const auto &range : ranges)
+	{
+		const Texture *texture = nullptr;
+
+		if (range.layer_id != no_layer)
+		{
+			auto found = layers.find(range.layer_id);
+			texture = found != std::end(layers) ? &found->second : nullptr;
+		}
+		else
+		{
+			auto found = textures.find(range.texture);
+			texture = found != std::end(textures) ? &found->second : nullptr;
+		}
+
+		if (range.topology == quad_topology)
+		{
+			for (std::size_t i = 0; i < range.count; ++i)
+				add_quad(render_list.quads[range.first + i], texture);
+
+			continue;
+		}
+
+		std::size_t n = range.count;
+
+		expanded.resize(n);
+		expand_vertices(std::data(expanded), &render_list.vertices[range.first],
+			range.textured ? &render_list.tex_coords[range.tex_first] : nullptr, n);
+
+		const Vertex *v = std::data(expanded);
+
+		switch (range.topology)
+		{
+		case D3DPT_POINTLIST:
+			for (std::size_t i = 0; i < n; ++i)
+				add_primitive(Kind::point, &v[i], &v[i], &v[i], texture);
+			break;
+		case D3DPT_LINELIST:
+			for (std::size_t i = 0; i + 1 < n; i += 2)
+				add_primitive(Kind::line, &v[i], &v[i + 1], &v[i + 1], texture);
+			break;
+		case D3DPT_LINESTRIP:
+			for (std::size_t i = 0; i + 1 < n; ++i)
+				add_primitive(Kind::line, &v[i], &v[i + 1], &v[i + 1], texture);
+			break;
+		case D3DPT_TRIANGLELIST:
+			for (std::size_t i = 0; i + 2 < n; i += 3)
+			{
+				if (i + 5 < n && add_rect(&v[i], texture))
+				{
+					i += 3;
+					continue;
+				}
+
+				add_primitive(Kind::triangle, &v[i], &v[i + 1], &v[i + 2], texture);
+			}
+			break;
+		case D3DPT_TRIANGLESTRIP:
+			// every odd triangle is flipped back to the strip's winding
+			for (std::size_t i = 0; i + 2 < n; ++i)
+			{
+				if (i & 1)
+					add_primitive(Kind::triangle, &v[i + 1], &v[i], &v[i + 2], texture);
+				else
+					add_primitive(Kind::triangle, &v[i], &v[i + 1], &v[i + 2], texture);
+			}
+			break;
+		case D3DPT_TRIANGLEFAN:
+			for (std::size_t i = 1; i + 1 < n; ++i)
+				add_primitive(Kind::triangle, &v[0], &v[i], &v[i + 1], texture);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+namespace /* anonymous namespace */
+{
+	float triangle_area(const Vertex &a, const Vertex &b, const Vertex &c)
+	{
+		return (b.position.x - a.position.x) * (c.position.y - a.position.y) - (b.position.y - a.position.y) * (c.position.x - a.position.x);
+	}
+};
+
+void SoftwareRasterizer::add_primitive(Kind kind, const Vertex *a, const Vertex *b, const Vertex *c, const Texture *texture)
+{
+	Primitive primitive;
+	primitive.kind = kind;
+	primitive.texture = texture;
+
+	const Vertex *source[] { a, b, c };
+
+	for (int i = 0; i < 3; ++i)
+	{
+		const Vertex &s = *source[i];
+
+		primitive.v[i] = RasterVertex
+		{
+			s.position.x, s.position.y,
+			static_cast<float>((s.color >> 16) & 0xff), static_cast<float>((s.color >> 8) & 0xff),
+			static_cast<float>(s.color & 0xff), static_cast<float>((s.color >> 24) & 0xff),
+			s.tex.x, s.tex.y
+		};
+	}
+
+	const RasterVertex &v0 = primitive.v[0], &v1 = primitive.v[1], &v2 = primitive.v[2];
+
+	switch (kind)
+	{
+	case Kind::triangle:
+		// CCW culling, clockwise triangles have positive area with y pointing down
+		if (!(triangle_area(*a, *b, *c) > 0.f))
+			return;
+
+		primitive.min_x = static_cast<long>(std::ceil(std::min({ v0.x, v1.x, v2.x })));
+		primitive.min_y = static_cast<long>(std::ceil(std::min({ v0.y, v1.y, v2.y })));
+		primitive.max_x = static_cast<long>(std::floor(std::max({ v0.x, v1.x, v2.x })));
+		primitive.max_y = static_cast<long>(std::floor(std::max({ v0.y, v1.y, v2.y })));
+		break;
+	case Kind::rect:
+		// left/top edges are inclusive, right/bottom edges exclusive
+		primitive.min_x = static_cast<long>(std::ceil(v0.x));
+		primitive.min_y = static_cast<long>(std::ceil(v0.y));
+		primitive.max_x = static_cast<long>(std::ceil(v1.x)) - 1;
+		primitive.max_y = static_cast<long>(std::ceil(v1.y)) - 1;
+		break;
+	default:
+		primitive.min_x = static_cast<long>(std::floor(std::min(v0.x, v1.x) + 0.5f));
+		primitive.min_y = static_cast<long>(std::floor(std::min(v0.y, v1.y) + 0.5f));
+		primitive.max_x = static_cast<long>(std::floor(std::max(v0.x, v1.x) + 0.5f));
+		primitive.max_y = static_cast<long>(std::floor(std::max(v0.y, v1.y) + 0.5f));
+		break;
+	}
+
+	primitive.min_x = std::max(primitive.min_x, 0L);
+	primitive.min_y = std::max(primitive.min_y, 0L);
+	primitive.max_x = std::min(primitive.max_x, width - 1);
+	primitive.max_y = std::min(primitive.max_y, height - 1);
+
+	if (primitive.min_x > primitive.max_x || primitive.min_y > primitive.max_y)
+		return;
+
+	primitives.push_back(primitive);
+}
+
+bool SoftwareRasterizer::add_rect(const Vertex *v, const Texture *texture)
+{
+	float x0 = v[0].position.x, x1 = x0;
+	float y0 = v[0].position.y, y1 = y0;
+
+	for (int i = 1; i < 6; ++i)
+	{
+		x0 = std::min(x0, v[i].position.x);
+		x1 = std::max(x1, v[i].position.x);
+		y0 = std::min(y0, v[i].position.y);
+		y1 = std::max(y1, v[i].position.y);
+	}
+
+	if (x0 == x1 || y0 == y1)
+		return false;
+
+	int corners[2] = {};
+	float u[2], tv[2];
+	bool seen_u[2] = {}, seen_v[2] = {};
+
+	for (int i = 0; i < 6; ++i)
+	{
+		const Vertex &vertex = v[i];
+
+		bool right = vertex.position.x == x1;
+		bool bottom = vertex.position.y == y1;
+
+		// every vertex on a corner, one colour, and u/v only depending on the corner's x/y
+		if ((!right && vertex.position.x != x0) || (!bottom && vertex.position.y != y0) || vertex.color != v[0].color)
+			return false;
+
+		if (seen_u[right] && u[right] != vertex.tex.x)
+			return false;
+
+		if (seen_v[bottom] && tv[bottom] != vertex.tex.y)
+			return false;
+
+		u[right] = vertex.tex.x;
+		tv[bottom] = vertex.tex.y;
+		seen_u[right] = seen_v[bottom] = true;
+
+		corners[i / 3] |= 1 << (right | bottom << 1);
+	}
+
+	auto missing = [](int mask) { return mask == 0x7 ? 3 : mask == 0xb ? 2 : mask == 0xd ? 1 : mask == 0xe ? 0 : -1; };
+
+	// both halves need three distinct corners and must be split along a diagonal
+	int missing0 = missing(corners[0]);
+	int missing1 = missing(corners[1]);
+
+	if (missing0 < 0 || missing1 < 0 || (missing0 ^ missing1) != 3)
+		return false;
+
+	if (!(triangle_area(v[0], v[1], v[2]) > 0.f) || !(triangle_area(v[3], v[4], v[5]) > 0.f))
+		return false;
+
+	Vertex top_left{ Vec4{ x0, y0, 1.f, 1.f }, v[0].color, Vec2{ u[0], tv[0] } };
+	Vertex bottom_right{ Vec4{ x1, y1, 1.f, 1.f }, v[0].color, Vec2{ u[1], tv[1] } };
+
+	add_primitive(Kind::rect, &top_left, &bottom_right, &bottom_right, texture);
+	return true;
+}
+
+void SoftwareRasterizer::add_quad(const QuadInstance &quad, const Texture *texture)
+{
+	// a negative extent flips the winding of the instanced quad, which CCW culling drops
+	if (!(quad.rect.z > 0.f) || !(quad.rect.w > 0.f))
+		return;
+
+	Vertex top_left{ Vec4{ quad.rect.x, quad.rect.y, 1.f, 1.f }, quad.color, Vec2{ quad.uv.x, quad.uv.y } };
+	Vertex bottom_right{ Vec4{ quad.rect.x + quad.rect.z, quad.rect.y + quad.rect.w, 1.f, 1.f }, quad.color, Vec2{ quad.uv.z, quad.uv.w } };
+
+	add_primitive(Kind::rect, &top_left, &bottom_right, &bottom_right, texture);
+}
+
+void SoftwareRasterizer::bin()
+{
+	for (auto &bin : bins)
+		bin.clear();
+
+	for (std::size_t i = 0; i < std::size(primitives); ++i)
+	{
+		const Primitive &primitive = primitives[i];
+
+		for (long ty = primitive.min_y / tile_size; ty <= primitive.max_y / tile_size; ++ty)
+		{
+			for (long tx = primitive.min_x / tile_size; tx <= primitive.max_x / tile_size; ++tx)
+				bins[ty * tiles_x + tx].push_back(static_cast<std::uint32_t>(i));
+		}
+	}
+}
+
+void SoftwareRasterizer::rasterize_tile(std::size_t tile)
+{
+	long tile_x0 = (static_cast<long>(tile) % tiles_x) * tile_size;
+	long tile_y0 = (static_cast<long>(tile) / tiles_x) * tile_size;
+	long tile_x1 = std::min(tile_x0 + tile_size, width) - 1;
+	long tile_y1 = std::min(tile_y0 + tile_size, height) - 1;
+
+	for (std::uint32_t index : bins[tile])
+	{
+		const Primitive &primitive = primitives[index];
+
+		long x0 = std::max(primitive.min_x, tile_x0);
+		long y0 = std::max(primitive.min_y, tile_y0);
+		long x1 = std::min(primitive.max_x, tile_x1);
+		long y1 = std::min(primitive.max_y, tile_y1);
+
+		if (x0 > x1 || y0 > y1)
+			continue;
+
+		switch (primitive.kind)
+		{
+		case Kind::triangle:
+			rasterize_triangle(primitive, x0, y0, x1, y1);
+			break;
+		case Kind::rect:
+			rasterize_rect(primitive, x0, y0, x1, y1);
+			break;
+		default:
+			rasterize_line(primitive, x0, y0, x1, y1);
+			break;
+		}
+	}
+}
+
+namespace /* anonymous namespace */
+{
+	struct Edge
+	{
+		// E(x, y) = c + x * dx + y * dy, positive inside
+		float c, dx, dy;
+		bool top_left;
+	};
+
+	Edge make_edge(float ax, float ay, float bx, float by)
+	{
+		float ex = bx - ax;
+		float ey = by - ay;
+
+		return Edge{ ax * ey - ay * ex, -ey, ex, (ey == 0.f && ex > 0.f) || ey < 0.f };
+	}
+
+	inline __m128 edge_mask(__m128 e, bool top_left)
+	{
+		__m128 zero = _mm_setzero_ps();
+		return top_left ? _mm_cmpge_ps(e, zero) : _mm_cmpgt_ps(e, zero);
+	}
+
+	inline __m128 channel(__m128i pixels, int shift)
+	{
+		return _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, shift), _mm_set1_epi32(0xff)));
+	}
+
+	// src * alpha + dst * (1 - alpha) on four pixels, premultiplied holds the colour channels and alpha already scaled by alpha
+	inline __m128i blend(__m128i dst, const __m128 premultiplied[4], __m128 inv_alpha)
+	{
+		__m128i r = _mm_cvtps_epi32(_mm_add_ps(premultiplied[0], _mm_mul_ps(channel(dst, 16), inv_alpha)));
+		__m128i g = _mm_cvtps_epi32(_mm_add_ps(premultiplied[1], _mm_mul_ps(channel(dst, 8), inv_alpha)));
+		__m128i b = _mm_cvtps_epi32(_mm_add_ps(premultiplied[2], _mm_mul_ps(channel(dst, 0), inv_alpha)));
+		__m128i a = _mm_cvtps_epi32(_mm_add_ps(premultiplied[3], _mm_mul_ps(channel(dst, 24), inv_alpha)));
+
+		return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(a, 24), _mm_slli_epi32(r, 16)), _mm_or_si128(_mm_slli_epi32(g, 8), b));
+	}
+
+	// src channels in [0, 255], colour is scaled by alpha unless src is premultiplied (layers), and alpha is
+	// unless it blends separately
+	inline __m128i blend(__m128i dst, const __m128 src[4], bool src_premultiplied, bool separate_alpha)
+	{
+		__m128 alpha = _mm_mul_ps(src[3], _mm_set1_ps(1.f / 255.f));
+		__m128 scale = src_premultiplied ? _mm_set1_ps(1.f) : alpha;
+		__m128 premultiplied[4] { _mm_mul_ps(src[0], scale), _mm_mul_ps(src[1], scale), _mm_mul_ps(src[2], scale),
+			separate_alpha ? src[3] : _mm_mul_ps(src[3], scale) };
+
+		return blend(dst, premultiplied, _mm_sub_ps(_mm_set1_ps(1.f), alpha));
+	}
+
+	// writes result where mask is set and keeps dst elsewhere
+	inline void store(std::uint32_t *dst, __m128 mask, __m128i old_pixels, __m128i result)
+	{
+		__m128i keep = _mm_castps_si128(mask);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_or_si128(_mm_and_si128(keep, result), _mm_andnot_si128(keep, old_pixels)));
+	}
+
+	inline std::uint32_t sample(const std::vector<std::uint32_t> &pixels, long width, long height, float u, float v)
+	{
+		// point sampling with wrap addressing, the device default
+		long x = static_cast<long>(std::floor(u * width)) % width;
+		long y = static_cast<long>(std::floor(v * height)) % height;
+
+		if (x < 0) x += width;
+		if (y < 0) y += height;
+
+		return pixels[y * width + x];
+	}
+
+	// multiplies src by the four texels, the default MODULATE stage setup
+	inline void modulate(__m128 src[4], const std::uint32_t *texels)
+	{
+		const __m128 inv_255 = _mm_set1_ps(1.f / 255.f);
+		__m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i *>(texels));
+
+		src[0] = _mm_mul_ps(src[0], _mm_mul_ps(channel(t, 16), inv_255));
+		src[1] = _mm_mul_ps(src[1], _mm_mul_ps(channel(t, 8), inv_255));
+		src[2] = _mm_mul_ps(src[2], _mm_mul_ps(channel(t, 0), inv_255));
+		src[3] = _mm_mul_ps(src[3], _mm_mul_ps(channel(t, 24), inv_255));
+	}
+};
+
+void SoftwareRasterizer::rasterize_triangle(const Primitive &primitive, long x0, long y0, long x1, long y1)
+{
+	const RasterVertex &v0 = primitive.v[0], &v1 = primitive.v[1], &v2 = primitive.v[2];
+
+	// edge k lies opposite vertex k, so E_k / area is the barycentric weight of vertex k
+	Edge e0 = make_edge(v1.x, v1.y, v2.x, v2.y);
+	Edge e1 = make_edge(v2.x, v2.y, v0.x, v0.y);
+	Edge e2 = make_edge(v0.x, v0.y, v1.x, v1.y);
+
+	float inv_area = 1.f / (e2.c + v2.x * e2.dx + v2.y * e2.dy);
+
+	const Texture *texture = primitive.texture;
+	bool flat = !texture && v0.r == v1.r && v0.r == v2.r && v0.g == v1.g && v0.g == v2.g &&
+		v0.b == v1.b && v0.b == v2.b && v0.a == v1.a && v0.a == v2.a;
+
+	if (flat && v0.a < 7.5f)
+		return;
+
+	const __m128 lane = _mm_set_ps(3.f, 2.f, 1.f, 0.f);
+	const __m128 scale = _mm_set1_ps(inv_area);
+	const __m128 alpha_ref = _mm_set1_ps(7.5f);
+	const __m128 span_x0 = _mm_set1_ps(static_cast<float>(x0));
+	const __m128 span_x1 = _mm_set1_ps(static_cast<float>(x1));
+
+	// attribute = a0 + w1 * (a1 - a0) + w2 * (a2 - a0)
+	const float base[6] { v0.r, v0.g, v0.b, v0.a, v0.u, v0.v };
+	const float d1[6] { v1.r - v0.r, v1.g - v0.g, v1.b - v0.b, v1.a - v0.a, v1.u - v0.u, v1.v - v0.v };
+	const float d2[6] { v2.r - v0.r, v2.g - v0.g, v2.b - v0.b, v2.a - v0.a, v2.u - v0.u, v2.v - v0.v };
+
+	float flat_alpha = v0.a / 255.f;
+	const __m128 flat_premultiplied[4] { _mm_set1_ps(v0.r * flat_alpha), _mm_set1_ps(v0.g * flat_alpha), _mm_set1_ps(v0.b * flat_alpha),
+		_mm_set1_ps(separate_alpha ? v0.a : v0.a * flat_alpha) };
+	bool premultiplied = texture && texture->premultiplied;
+	const __m128 flat_inv_alpha = _mm_set1_ps(1.f - flat_alpha);
+
+	long group_x0 = x0 & ~3L;
+
+	const __m128 step0 = _mm_set1_ps(4.f * e0.dx);
+	const __m128 step1 = _mm_set1_ps(4.f * e1.dx);
+	const __m128 step2 = _mm_set1_ps(4.f * e2.dx);
+
+	for (long y = y0; y <= y1; ++y)
+	{
+		std::uint32_t *row = &pixels[y * pitch];
+		float fy = static_cast<float>(y);
+
+		__m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(group_x0)), lane);
+
+		__m128 w0 = _mm_add_ps(_mm_set1_ps(e0.c + fy * e0.dy), _mm_mul_ps(px, _mm_set1_ps(e0.dx)));
+		__m128 w1 = _mm_add_ps(_mm_set1_ps(e1.c + fy * e1.dy), _mm_mul_ps(px, _mm_set1_ps(e1.dx)));
+		__m128 w2 = _mm_add_ps(_mm_set1_ps(e2.c + fy * e2.dy), _mm_mul_ps(px, _mm_set1_ps(e2.dx)));
+
+		for (long x = group_x0; x <= x1; x += 4, px = _mm_add_ps(px, _mm_set1_ps(4.f)),
+			w0 = _mm_add_ps(w0, step0), w1 = _mm_add_ps(w1, step1), w2 = _mm_add_ps(w2, step2))
+		{
+			__m128 mask = _mm_and_ps(_mm_and_ps(edge_mask(w0, e0.top_left), edge_mask(w1, e1.top_left)), edge_mask(w2, e2.top_left));
+
+			// clip to the tile's span
+			mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(px, span_x0), _mm_cmple_ps(px, span_x1)));
+
+			if (_mm_movemask_ps(mask) == 0)
+				continue;
+
+			__m128i dst = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&row[x]));
+
+			if (flat)
+			{
+				store(&row[x], mask, dst, blend(dst, flat_premultiplied, flat_inv_alpha));
+				continue;
+			}
+
+			__m128 b1 = _mm_mul_ps(w1, scale);
+			__m128 b2 = _mm_mul_ps(w2, scale);
+
+			__m128 src[4];
+			for (int i = 0; i < 4; ++i)
+				src[i] = _mm_add_ps(_mm_set1_ps(base[i]), _mm_add_ps(_mm_mul_ps(b1, _mm_set1_ps(d1[i])), _mm_mul_ps(b2, _mm_set1_ps(d2[i]))));
+
+			if (texture)
+			{
+				alignas(16) float u[4], v[4];
+				std::uint32_t texels[4];
+
+				_mm_store_ps(u, _mm_add_ps(_mm_set1_ps(base[4]), _mm_add_ps(_mm_mul_ps(b1, _mm_set1_ps(d1[4])), _mm_mul_ps(b2, _mm_set1_ps(d2[4])))));
+				_mm_store_ps(v, _mm_add_ps(_mm_set1_ps(base[5]), _mm_add_ps(_mm_mul_ps(b1, _mm_set1_ps(d1[5])), _mm_mul_ps(b2, _mm_set1_ps(d2[5])))));
+
+				for (int i = 0; i < 4; ++i)
+					texels[i] = sample(texture->pixels, texture->width, texture->height, u[i], v[i]);
+
+				modulate(src, texels);
+			}
+
+			mask = _mm_and_ps(mask, _mm_cmpge_ps(src[3], alpha_ref));
+			if (_mm_movemask_ps(mask) == 0)
+				continue;
+
+			store(&row[x], mask, dst, blend(dst, src, premultiplied, separate_alpha));
+		}
+	}
+}
+
+void SoftwareRasterizer::rasterize_rect(const Primitive &primitive, long x0, long y0, long x1, long y1)
+{
+	const RasterVertex &a = primitive.v[0], &b = primitive.v[1];
+	const Texture *texture = primitive.texture;
+
+	if (a.a < 7.5f)
+		return;
+
+	const __m128 lane = _mm_set_ps(3.f, 2.f, 1.f, 0.f);
+	const __m128 span_x0 = _mm_set1_ps(static_cast<float>(x0));
+	const __m128 span_x1 = _mm_set1_ps(static_cast<float>(x1));
+
+	long group_x0 = x0 & ~3L;
+
+	if (!texture)
+	{
+		float alpha = a.a / 255.f;
+		const __m128 premultiplied[4] { _mm_set1_ps(a.r * alpha), _mm_set1_ps(a.g * alpha), _mm_set1_ps(a.b * alpha),
+			_mm_set1_ps(separate_alpha ? a.a : a.a * alpha) };
+		const __m128 inv_alpha = _mm_set1_ps(1.f - alpha);
+
+		for (long y = y0; y <= y1; ++y)
+		{
+			std::uint32_t *row = &pixels[y * pitch];
+
+			for (long x = group_x0; x <= x1; x += 4)
+			{
+				__m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), lane);
+				__m128 mask = _mm_and_ps(_mm_cmpge_ps(px, span_x0), _mm_cmple_ps(px, span_x1));
+
+				__m128i dst = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&row[x]));
+				store(&row[x], mask, dst, blend(dst, premultiplied, inv_alpha));
+			}
+		}
+
+		return;
+	}
+
+	const __m128 alpha_ref = _mm_set1_ps(7.5f);
+
+	float du = (b.u - a.u) / (b.x - a.x);
+	float dv = (b.v - a.v) / (b.y - a.y);
+
+	for (long y = y0; y <= y1; ++y)
+	{
+		std::uint32_t *row = &pixels[y * pitch];
+		float v = a.v + (static_cast<float>(y) - a.y) * dv;
+
+		for (long x = group_x0; x <= x1; x += 4)
+		{
+			__m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), lane);
+			__m128 mask = _mm_and_ps(_mm_cmpge_ps(px, span_x0), _mm_cmple_ps(px, span_x1));
+
+			std::uint32_t texels[4];
+			for (int i = 0; i < 4; ++i)
+				texels[i] = sample(texture->pixels, texture->width, texture->height, a.u + (static_cast<float>(x + i) - a.x) * du, v);
+
+			__m128 src[4] { _mm_set1_ps(a.r), _mm_set1_ps(a.g), _mm_set1_ps(a.b), _mm_set1_ps(a.a) };
+			modulate(src, texels);
+
+			mask = _mm_and_ps(mask, _mm_cmpge_ps(src[3], alpha_ref));
+			if (_mm_movemask_ps(mask) == 0)
+				continue;
+
+			__m128i dst = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&row[x]));
+			store(&row[x], mask, dst, blend(dst, src, texture->premultiplied, separate_alpha));
+		}
+	}
+}
+
+void SoftwareRasterizer::rasterize_line(const Primitive &primitive, long x0, long y0, long x1, long y1)
+{
+	const RasterVertex &a = primitive.v[0], &b = primitive.v[1];
+
+	auto shade = [&](float t, long x, long y)
+	{
+		if (x < x0 || x > x1 || y < y0 || y > y1)
+			return;
+
+		shade_pixel(pixels[y * pitch + x],
+			a.r + (b.r - a.r) * t, a.g + (b.g - a.g) * t, a.b + (b.b - a.b) * t, a.a + (b.a - a.a) * t,
+			primitive.texture, a.u + (b.u - a.u) * t, a.v + (b.v - a.v) * t);
+	};
+
+	if (primitive.kind == Kind::point)
+	{
+		shade(0.f, static_cast<long>(std::floor(a.x + 0.5f)), static_cast<long>(std::floor(a.y + 0.5f)));
+		return;
+	}
+
+	float dx = b.x - a.x;
+	float dy = b.y - a.y;
+
+	// the last pixel is left out like on the device so connected lines don't overdraw their joints
+	long steps = static_cast<long>(std::floor(std::max(std::abs(dx), std::abs(dy)) + 0.5f));
+
+	for (long i = 0; i < steps; ++i)
+	{
+		float t = static_cast<float>(i) / static_cast<float>(steps);
+		shade(t, static_cast<long>(std::floor(a.x + dx * t + 0.5f)), static_cast<long>(std::floor(a.y + dy * t + 0.5f)));
+	}
+}
+
+void SoftwareRasterizer::shade_pixel(std::uint32_t &dst, float r, float g, float b, float a, const Texture *texture, float u, float v)
+{
+	if (texture)
+	{
+		std::uint32_t texel = sample(texture->pixels, texture->width, texture->height, u, v);
+
+		r *= ((texel >> 16) & 0xff) / 255.f;
+		g *= ((texel >> 8) & 0xff) / 255.f;
+		b *= (texel & 0xff) / 255.f;
+		a *= ((texel >> 24) & 0xff) / 255.f;
+	}
+
+	if (a < 7.5f)
+		return;
+
+	float src_alpha = a / 255.f;
+	float dst_alpha = 1.f - src_alpha;
+	float color_scale = texture && texture->premultiplied ? 1.f : src_alpha;
+
+	auto blend = [&](float src, float scale, int shift)
+	{
+		float value = src * scale + static_cast<float>((dst >> shift) & 0xff) * dst_alpha;
+		return static_cast<std::uint32_t>(value + 0.5f) << shift;
+	};
+
+	dst = blend(a, separate_alpha ? 1.f : color_scale, 24) | blend(r, color_scale, 16) | blend(g, color_scale, 8) | blend(b, color_scale, 0);
+}
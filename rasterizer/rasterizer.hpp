@@ -0,0 +1,136 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <unordered_map>
+
+#include "renderer.hpp"
+
+class ThreadPool
+{
+public:
+	explicit ThreadPool(std::size_t num_threads);
+	~ThreadPool();
+
+	// Calls job(i) for every i in [0, count) on the pool and the calling thread, returns once all are done.
+	void run(std::size_t count, const std::function<void(std::size_t)> &job);
+
+private:
+	void work();
+	void drain();
+
+	std::vector<std::thread>                 threads;
+	std::mutex                               mutex;
+	std::condition_variable                  wake;
+	std::condition_variable                  done;
+
+	const std::function<void(std::size_t)>  *job;
+	std::size_t                              count;
+	std::atomic<std::size_t>                 next;
+	std::size_t                              active;
+	std::uint64_t                            generation;
+	bool                                     stop;
+};
+
+// Rasterises render lists into an A8R8G8B8 buffer without a device, using the blend and alpha test states
+// Renderer::reacquire() sets up (src alpha / inv src alpha, alpha >= 0x08, CCW culling, point sampling).
+// Layer quads blend premultiplied (one / inv src alpha) like on the device.
+// Primitives are binned into 64x64 tiles which are filled in parallel, four pixels at a time with SSE2.
+// Triangle pairs forming an axis-aligned quad (rects, glyphs, images) are filled as plain spans.
+class SoftwareRasterizer
+{
+public:
+	SoftwareRasterizer(long width, long height, std::size_t num_threads = std::thread::hardware_concurrency());
+
+	// CPU copy of a texture referenced by batches, tightly packed A8R8G8B8 rows. Unbound textures sample white.
+	void bind_texture(IDirect3DTexture9 *texture, const std::uint32_t *pixels, long width, long height);
+	void unbind_texture(IDirect3DTexture9 *texture);
+
+	// CPU copy of a layer's contents for draw_layer() quads, premultiplied like the layer texture. Render the
+	// layer's list with set_separate_alpha(true) into a rasterizer cleared to 0 to produce them. Rows are pitch
+	// apart, only width pixels of each are copied, so a rasterizer's padded rows can be passed as they are.
+	void bind_layer(LayerHandle layer, const std::uint32_t *pixels, long width, long height, long pitch);
+	void unbind_layer(LayerHandle layer);
+
+	// While enabled, alpha accumulates as src + dst * (1 - src) as it does while Renderer renders a layer.
+	void set_separate_alpha(bool enable);
+
+	void clear(Color color = 0UL);
+	void draw(const RenderListPtr &render_list);
+
+	long get_width() const;
+	long get_height() const;
+
+	// rows are get_pitch() pixels apart
+	long get_pitch() const;
+	const std::vector<std::uint32_t> &get_pixels() const;
+
+private:
+	static constexpr long tile_size = 64;
+
+	struct Texture
+	{
+		std::vector<std::uint32_t> pixels;
+		long                       width;
+		long                       height;
+		bool                       premultiplied;
+	};
+
+	struct RasterVertex
+	{
+		float x, y;
+		float r, g, b, a;
+		float u, v;
+	};
+
+	enum class Kind
+	{
+		point,
+		line,
+		triangle,
+		rect
+	};
+
+	// rects are two triangles covering an axis-aligned rectangle, v[0] holds the top left and v[1] the bottom right corner
+	struct Primitive
+	{
+		Kind            kind;
+		RasterVertex    v[3];
+		const Texture  *texture;
+		long            min_x, min_y, max_x, max_y;
+	};
+
+	void setup(const RenderList &render_list);
+	void add_primitive(Kind kind, const Vertex *a, const Vertex *b, const Vertex *c, const Texture *texture);
+	bool add_rect(const Vertex *v, const Texture *texture);
+	void add_quad(const QuadInstance &quad, const Texture *texture);
+	void bin();
+
+	void rasterize_tile(std::size_t tile);
+	void rasterize_triangle(const Primitive &primitive, long x0, long y0, long x1, long y1);
+	void rasterize_rect(const Primitive &primitive, long x0, long y0, long x1, long y1);
+	void rasterize_line(const Primitive &primitive, long x0, long y0, long x1, long y1);
+	void shade_pixel(std::uint32_t &dst, float r, float g, float b, float a, const Texture *texture, float u, float v);
+
+	long                                                      width;
+	long                                                      height;
+	long                                                      pitch;
+	long                                                      tiles_x;
+	long                                                      tiles_y;
+	std::vector<std::uint32_t>                                pixels;
+	bool                                                      separate_alpha;
+
+	std::unordered_map<IDirect3DTexture9 *, Texture>          textures;
+	std::unordered_map<std::size_t, Texture>                  layers;
+	std::vector<SortEntry>                                    sorted_commands;
+	std::vector<SortEntry>                                    sort_scratch;
+	std::vector<Vertex>                                       expanded;
+	std::vector<Primitive>                                    primitives;
+	std::vector<std::vector<std::uint32_t>>                   bins;
+
+	ThreadPool                                                pool;
+};
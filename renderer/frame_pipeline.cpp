@@ -0,0 +1,47 @@
+#include "frame_pipeline.hpp"
+
+FramePipeline::FramePipeline(const RendererPtr &renderer, std::size_t num_lists) :
+	renderer(renderer), recording(0), submitting(2), pending(1)
+{
+	if (!renderer)
+		throw std::exception("FramePipeline::ctor: Renderer was nullptr!");
+
+	for (auto &frame : frames)
+	{
+		for (std::size_t i = 0; i < num_lists; ++i)
+			frame.push_back(renderer->make_render_list());
+	}
+}
+
+RenderListPtr FramePipeline::get_list(std::size_t index)
+{
+	std::vector<RenderListPtr> &frame = frames[recording.load(std::memory_order_acquire)];
+
+	if (index >= std::size(frame))
+		throw std::exception(fmt::format("FramePipeline::get_list: Bad list index (index: {})!", index).c_str());
+
+	return frame[index];
+}
+
+void FramePipeline::publish()
+{
+	std::uint32_t next = pending.exchange(recording.load(std::memory_order_relaxed) | fresh_bit, std::memory_order_acq_rel) & index_mask;
+
+	// cleared before it is handed to the producers
+	for (const auto &render_list : frames[next])
+		render_list->clear();
+
+	recording.store(next, std::memory_order_release);
+}
+
+bool FramePipeline::draw()
+{
+	bool fresh = (pending.load(std::memory_order_relaxed) & fresh_bit) != 0;
+
+	if (fresh)
+		submitting = pending.exchange(submitting, std::memory_order_acq_rel) & index_mask;
+
+	renderer->draw(frames[submitting]);
+
+	return fresh;
+}
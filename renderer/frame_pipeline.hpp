@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "renderer.hpp"
+
+// Triple-buffered frame storage decoupling recording from the device thread. Producers record frame N+1
+// into get_list() while the device thread draws frame N; publish() and draw() hand frames over with a
+// single atomic exchange. Frames published faster than they are drawn replace each other.
+class FramePipeline
+{
+public:
+	FramePipeline(const RendererPtr &renderer, std::size_t num_lists);
+
+	// Recording side. publish() must be called once every producer has finished the frame, and producers
+	// must only fetch the lists of the next frame after publish() returned; the release store of recording
+	// in publish() pairs with the acquire load in get_list().
+	RenderListPtr get_list(std::size_t index);
+	void publish();
+
+	// Device thread, draws the newest published frame, returns whether it was new. Without a new frame the
+	// last one is drawn again, which uploads all of its vertices again as the vertex buffer is discarded by
+	// every draw; callers that keep the back buffer can skip the draw when this returned false before.
+	bool draw();
+
+private:
+	static constexpr std::uint32_t index_mask = 0x3;
+	static constexpr std::uint32_t fresh_bit  = 0x4;
+
+	RendererPtr                                renderer;
+	std::array<std::vector<RenderListPtr>, 3>  frames;
+
+	std::atomic<std::uint32_t>                 recording;
+	std::uint32_t                              submitting;
+	std::atomic<std::uint32_t>                 pending;
+};
@@ -1,180 +1,1271 @@
 #include "renderer.hpp"
+#include "capture.hpp"
+
+#include <emmintrin.h>
+#include <type_traits>
 
 Renderer::Renderer(IDirect3DDevice9 *device, std::size_t max_vertices) :
 	device(device), vertex_buffer(nullptr), max_vertices(max_vertices), render_list(std::make_shared<RenderList>(max_vertices)),
-	prev_state_block(nullptr), render_state_block(nullptr)
+	prev_state_block(nullptr), render_state_block(nullptr), immediate(false), immediate_data(nullptr), immediate_offset(0),
+	immediate_start(0), immediate_batch(0, D3DPT_FORCE_DWORD), instancing(false), instancing_bound(false),
+	quad_declaration(nullptr), quad_vertex_shader(nullptr), quad_texture_shader(nullptr), quad_color_shader(nullptr),
+	quad_buffer(nullptr), quad_indices(nullptr), instance_buffer(nullptr), max_quads(max_vertices / 6 + 1)
 {
 	if (!device)
 		throw std::exception("Renderer::ctor: Device was nullptr!");
 
-	reacquire();
-}
+	render_list->internal = true;
+
+	atlas = std::make_unique<Atlas>(device);
+
+	create_instancing();
+	reacquire();
+}
+
+Renderer::~Renderer()
+{
+	release();
+
+	safe_release(quad_color_shader);
+	safe_release(quad_texture_shader);
+	safe_release(quad_vertex_shader);
+	safe_release(quad_declaration);
+}
+
+void Renderer::reacquire()
+{
+	create_vertex_buffer();
+	create_quad_buffers();
+
+	render_state_block = record_state_block();
+	prev_state_block = record_state_block();
+
+	for (auto &layer : layers)
+	{
+		throw_if_failed(device->CreateTexture(layer.width, layer.height, 1, D3DUSAGE_RENDERTARGET, D3DFMT_A8R8G8B8,
+			D3DPOOL_DEFAULT, &layer.texture, nullptr));
+
+		layer.dirty = true;
+	}
+
+	name_capture_textures();
+}
+
+void Renderer::release()
+{
+	release_vertex_buffer();
+	release_quad_buffers();
+
+	safe_release(prev_state_block);
+	safe_release(render_state_block);
+
+	for (auto &layer : layers)
+		safe_release(layer.texture);
+}
+
+void Renderer::create_vertex_buffer()
+{
+	throw_if_failed(device->CreateVertexBuffer(max_vertices * sizeof(Vertex), D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY,
+		vertex_definition, D3DPOOL_DEFAULT, &vertex_buffer, nullptr));
+}
+
+void Renderer::release_vertex_buffer()
+{
+	if (immediate_data)
+	{
+		vertex_buffer->Unlock();
+		immediate_data = nullptr;
+	}
+
+	immediate_offset = 0;
+	immediate_batch = Batch{ 0, D3DPT_FORCE_DWORD };
+	immediate_vertices.clear();
+	immediate_tex_coords.clear();
+
+	safe_release(vertex_buffer);
+}
+
+IDirect3DStateBlock9 *Renderer::record_state_block()
+{
+	return record_render_states(device, vertex_definition, vertex_buffer, sizeof(Vertex));
+}
+
+IDirect3DStateBlock9 *record_render_states(IDirect3DDevice9 *device, unsigned long fvf, IDirect3DVertexBuffer9 *vertex_buffer, UINT stride)
+{
+	IDirect3DStateBlock9 *state_block = nullptr;
+
+	device->BeginStateBlock();
+
+	device->SetRenderState(D3DRS_ZENABLE, FALSE);
+
+	device->SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
+	device->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+	device->SetRenderState(D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+	device->SetRenderState(D3DRS_SEPARATEALPHABLENDENABLE, FALSE);
+	device->SetRenderState(D3DRS_SRCBLENDALPHA, D3DBLEND_ONE);
+	device->SetRenderState(D3DRS_DESTBLENDALPHA, D3DBLEND_INVSRCALPHA);
+
+	device->SetRenderState(D3DRS_ALPHATESTENABLE, TRUE);
+	device->SetRenderState(D3DRS_ALPHAREF, 0x08);
+	device->SetRenderState(D3DRS_ALPHAFUNC, D3DCMP_GREATEREQUAL);
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+
+	device->SetRenderState(D3DRS_FILLMODE, D3DFILL_SOLID);
+	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_CCW);
+	device->SetRenderState(D3DRS_STENCILENABLE, FALSE);
+	device->SetRenderState(D3DRS_CLIPPING, TRUE);
+	device->SetRenderState(D3DRS_CLIPPLANEENABLE, FALSE);
+	device->SetRenderState(D3DRS_VERTEXBLEND, D3DVBF_DISABLE);
+	device->SetRenderState(D3DRS_INDEXEDVERTEXBLENDENABLE, FALSE);
+	device->SetRenderState(D3DRS_FOGENABLE, FALSE);
+	device->SetRenderState(D3DRS_COLORWRITEENABLE,
+		D3DCOLORWRITEENABLE_RED | D3DCOLORWRITEENABLE_GREEN |
+		D3DCOLORWRITEENABLE_BLUE | D3DCOLORWRITEENABLE_ALPHA);
+
+	device->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
+	device->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+	device->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
+	device->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_MODULATE);
+	device->SetTextureStageState(0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
+	device->SetTextureStageState(0, D3DTSS_ALPHAARG2, D3DTA_DIFFUSE);
+	device->SetTextureStageState(0, D3DTSS_TEXCOORDINDEX, 0);
+	device->SetTextureStageState(0, D3DTSS_TEXTURETRANSFORMFLAGS, D3DTTFF_DISABLE);
+	device->SetTextureStageState(1, D3DTSS_COLOROP, D3DTOP_DISABLE);
+	device->SetTextureStageState(1, D3DTSS_ALPHAOP, D3DTOP_DISABLE);
+	device->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_POINT);
+	device->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_POINT);
+	device->SetSamplerState(0, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
+
+	device->SetFVF(fvf);
+	device->SetTexture(0, nullptr);
+	device->SetStreamSource(0, vertex_buffer, 0, stride);
+	device->SetStreamSource(1, nullptr, 0, 0);
+	device->SetStreamSourceFreq(0, 1);
+	device->SetStreamSourceFreq(1, 1);
+	device->SetIndices(nullptr);
+	device->SetVertexShader(nullptr);
+	device->SetPixelShader(nullptr);
+
+	device->EndStateBlock(&state_block);
+	return state_block;
+}
+
+namespace /* anonymous namespace */
+{
+	// c0: { 2 / width, -2 / height, -1 - 2 * x / width, 1 + 2 * y / height } of the viewport
+	const char quad_vertex_source[] = R"(
+		float4 viewport : register(c0);
+
+		struct Output
+		{
+			float4 position : POSITION;
+			float4 color    : COLOR0;
+			float2 tex      : TEXCOORD0;
+		};
+
+		Output main(float2 corner : POSITION0, float4 rect : TEXCOORD0, float4 uv : TEXCOORD1, float4 color : COLOR0)
+		{
+			Output output;
+			output.position = float4((rect.xy + corner * rect.zw) * viewport.xy + viewport.zw, 0.f, 1.f);
+			output.color = color;
+			output.tex = lerp(uv.xy, uv.zw, corner);
+			return output;
+		}
+	)";
+
+	// same as the fixed function stage: texture modulated by diffuse, diffuse alone without a texture
+	const char quad_texture_source[] = R"(
+		sampler2D tex : register(s0);
+
+		float4 main(float4 color : COLOR0, float2 uv : TEXCOORD0) : COLOR
+		{
+			return tex2D(tex, uv) * color;
+		}
+	)";
+
+	const char quad_color_source[] = R"(
+		float4 main(float4 color : COLOR0) : COLOR
+		{
+			return color;
+		}
+	)";
+
+	ID3DXBuffer *compile_shader(const char *source, std::size_t length, const char *profile)
+	{
+		ID3DXBuffer *code = nullptr;
+		ID3DXBuffer *errors = nullptr;
+
+		HRESULT hr = D3DXCompileShader(source, static_cast<UINT>(length), nullptr, nullptr, "main", profile, 0, &code, &errors, nullptr);
+		safe_release(errors);
+
+		return SUCCEEDED(hr) ? code : nullptr;
+	}
+};
+
+void Renderer::create_instancing()
+{
+	D3DCAPS9 caps;
+	if (FAILED(device->GetDeviceCaps(&caps)))
+		return;
+
+	if (caps.VertexShaderVersion < D3DVS_VERSION(3, 0) || caps.PixelShaderVersion < D3DPS_VERSION(3, 0) ||
+		!(caps.DevCaps2 & D3DDEVCAPS2_STREAMOFFSET))
+		return;
+
+	const D3DVERTEXELEMENT9 elements[]
+	{
+		{ 0, 0,  D3DDECLTYPE_FLOAT2,   D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0 },
+		{ 1, 0,  D3DDECLTYPE_FLOAT4,   D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 0 },
+		{ 1, 16, D3DDECLTYPE_FLOAT4,   D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 1 },
+		{ 1, 32, D3DDECLTYPE_D3DCOLOR, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_COLOR,    0 },
+		D3DDECL_END()
+	};
+
+	ID3DXBuffer *vertex_code = compile_shader(quad_vertex_source, sizeof(quad_vertex_source) - 1, "vs_3_0");
+	ID3DXBuffer *texture_code = compile_shader(quad_texture_source, sizeof(quad_texture_source) - 1, "ps_3_0");
+	ID3DXBuffer *color_code = compile_shader(quad_color_source, sizeof(quad_color_source) - 1, "ps_3_0");
+
+	// any failure keeps the fixed function path
+	instancing = vertex_code && texture_code && color_code &&
+		SUCCEEDED(device->CreateVertexDeclaration(elements, &quad_declaration)) &&
+		SUCCEEDED(device->CreateVertexShader(static_cast<const DWORD *>(vertex_code->GetBufferPointer()), &quad_vertex_shader)) &&
+		SUCCEEDED(device->CreatePixelShader(static_cast<const DWORD *>(texture_code->GetBufferPointer()), &quad_texture_shader)) &&
+		SUCCEEDED(device->CreatePixelShader(static_cast<const DWORD *>(color_code->GetBufferPointer()), &quad_color_shader));
+
+	safe_release(vertex_code);
+	safe_release(texture_code);
+	safe_release(color_code);
+}
+
+void Renderer::create_quad_buffers()
+{
+	if (!instancing)
+		return;
+
+	grow_instance_buffer(max_quads);
+
+	throw_if_failed(device->CreateVertexBuffer(4 * sizeof(Vec2), D3DUSAGE_WRITEONLY, 0, D3DPOOL_DEFAULT, &quad_buffer, nullptr));
+	throw_if_failed(device->CreateIndexBuffer(6 * sizeof(std::uint16_t), D3DUSAGE_WRITEONLY, D3DFMT_INDEX16, D3DPOOL_DEFAULT, &quad_indices, nullptr));
+
+	// unit quad in the winding of draw_filled_rect
+	const Vec2 corners[] { { 0.f, 0.f }, { 1.f, 0.f }, { 0.f, 1.f }, { 1.f, 1.f } };
+	const std::uint16_t indices[] { 0, 1, 2, 1, 3, 2 };
+
+	void *data;
+
+	throw_if_failed(quad_buffer->Lock(0, 0, &data, 0));
+	std::memcpy(data, corners, sizeof(corners));
+	quad_buffer->Unlock();
+
+	throw_if_failed(quad_indices->Lock(0, 0, &data, 0));
+	std::memcpy(data, indices, sizeof(indices));
+	quad_indices->Unlock();
+}
+
+void Renderer::release_quad_buffers()
+{
+	instancing_bound = false;
+
+	safe_release(instance_buffer);
+	safe_release(quad_buffer);
+	safe_release(quad_indices);
+}
+
+void Renderer::begin()
+{
+	prev_state_block->Capture();
+	render_state_block->Apply();
+}
+
+void Renderer::end()
+{
+	if (immediate)
+		flush_immediate();
+
+	if (capture)
+		capture->end_frame();
+
+	prev_state_block->Apply();
+}
+
+void Renderer::draw(const RenderListPtr &render_list)
+{
+	draw(std::span<const RenderListPtr>{ &render_list, 1 });
+}
+
+void Renderer::draw(std::span<const RenderListPtr> render_lists)
+{
+	update_layers();
+
+	if (capture)
+		capture->write_draw(render_lists);
+
+	submit(render_lists);
+}
+
+void Renderer::submit(std::span<const RenderListPtr> render_lists)
+{
+	if (immediate)
+	{
+		flush_immediate();
+		immediate_offset = 0;
+	}
+
+	std::size_t num_vertices = 0;
+	std::size_t num_quads = 0;
+
+	for (const auto &render_list : render_lists)
+	{
+		num_vertices += std::size(render_list->vertices);
+		num_quads += std::size(render_list->quads);
+	}
+
+	// lists replayed from a capture may hold quads this device cannot instance
+	if (!instancing)
+	{
+		num_vertices += 6 * num_quads;
+		num_quads = 0;
+	}
+
+	merged_batches.clear();
+
+	if (num_quads > 0)
+	{
+		void *data;
+
+		if (num_quads > max_quads)
+			grow_instance_buffer(num_quads);
+
+		throw_if_failed(instance_buffer->Lock(0, 0, &data, D3DLOCK_DISCARD));
+		{
+			QuadInstance *dst = static_cast<QuadInstance *>(data);
+
+			for (const auto &render_list : render_lists)
+			{
+				std::memcpy(dst, std::data(render_list->quads), sizeof(QuadInstance) * std::size(render_list->quads));
+				dst += std::size(render_list->quads);
+			}
+		}
+		instance_buffer->Unlock();
+	}
+
+	Vertex *dst = nullptr;
+
+	if (num_vertices > 0)
+	{
+		void *data;
+
+		if (num_vertices > max_vertices)
+			grow_vertex_buffer(num_vertices);
+
+		throw_if_failed(vertex_buffer->Lock(0, 0, &data, D3DLOCK_DISCARD));
+		dst = static_cast<Vertex *>(data);
+	}
+
+	// batches are merged even without vertices, a list may hold nothing but quads
+	for (const auto &render_list : render_lists)
+	{
+		if (render_list->layered)
+		{
+			dst = gather_layered(dst, *render_list);
+			continue;
+		}
+
+		dst = expand_list(dst, *render_list);
+		merge_list(*render_list);
+	}
+
+	if (num_vertices > 0)
+		vertex_buffer->Unlock();
+
+	std::size_t pos = 0;
+	std::size_t quad_pos = 0;
+
+	if (num_quads > 0)
+		begin_instancing();
+
+	for (const auto &batch : merged_batches)
+	{
+		if (!batch.count)
+			continue;
+
+		if (batch.topology == quad_topology)
+		{
+			draw_quads(batch, quad_pos);
+			quad_pos += batch.count;
+		}
+		else if (topology_order(batch.topology) > 0)
+		{
+			draw_batch(batch, pos);
+			pos += batch.count;
+		}
+	}
+
+	if (instancing_bound)
+		unbind_instancing();
+
+	if (num_quads > 0)
+		end_instancing();
+}
+
+void Renderer::draw(SubmissionQueue &queue)
+{
+	queued_submissions.clear();
+
+	// only taking the submissions holds the lock, workers can submit the next frame while this one draws
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		std::swap(queued_submissions, queue.submissions);
+	}
+
+	std::sort(std::begin(queued_submissions), std::end(queued_submissions),
+		[](const auto &lhs, const auto &rhs) { return lhs.order < rhs.order; });
+
+	// equal orders would be drawn in whichever order the threads happened to submit
+	auto duplicate = std::adjacent_find(std::begin(queued_submissions), std::end(queued_submissions),
+		[](const auto &lhs, const auto &rhs) { return lhs.order == rhs.order; });
+
+	if (duplicate != std::end(queued_submissions))
+		throw std::exception(fmt::format("Renderer::draw: Duplicate submission order ({})!", duplicate->order).c_str());
+
+	queued_lists.clear();
+	for (const auto &submission : queued_submissions)
+		queued_lists.push_back(submission.render_list);
+
+	draw(queued_lists);
+}
+
+void Renderer::draw()
+{
+	if (immediate)
+		flush_immediate();
+
+	draw(render_list);
+	render_list->clear();
+}
+
+void Renderer::begin_immediate()
+{
+	immediate = true;
+	immediate_offset = 0;
+	immediate_batch = Batch{ 0, D3DPT_FORCE_DWORD };
+}
+
+void Renderer::end_immediate()
+{
+	flush_immediate();
+	immediate = false;
+}
+
+void Renderer::set_capture(const std::shared_ptr<CaptureWriter> &capture)
+{
+	this->capture = capture;
+	name_capture_textures();
+}
+
+void Renderer::name_capture_textures()
+{
+	if (!capture)
+		return;
+
+	for (std::size_t i = 0; i < std::size(fonts); ++i)
+		capture->name_texture(fonts[i]->get_texture(), fmt::format("font:{}", i));
+
+	for (std::size_t i = 0; i < atlas->get_num_pages(); ++i)
+		capture->name_texture(atlas->get_page_texture(i), fmt::format("atlas:{}", i));
+
+}
+
+void Renderer::update_layers()
+{
+	// in creation order, so a layer may draw the layers created before it
+	for (auto &layer : layers)
+	{
+		if (layer.dirty || layer.revision != layer.render_list->revision)
+			update_layer(layer);
+	}
+}
+
+void Renderer::update_layer(Layer &layer)
+{
+	IDirect3DSurface9 *prev_target = nullptr;
+	IDirect3DSurface9 *prev_depth_stencil = nullptr;
+	IDirect3DSurface9 *surface = nullptr;
+	D3DVIEWPORT9 prev_viewport;
+
+	// pending immediate geometry belongs to the current target
+	if (immediate)
+		flush_immediate();
+
+	throw_if_failed(layer.texture->GetSurfaceLevel(0, &surface));
+	throw_if_failed(device->GetRenderTarget(0, &prev_target));
+	device->GetDepthStencilSurface(&prev_depth_stencil);
+	device->GetViewport(&prev_viewport);
+
+	// the depth surface may be smaller than the layer, z is never used anyway
+	device->SetDepthStencilSurface(nullptr);
+	device->SetRenderTarget(0, surface);
+	device->Clear(0, nullptr, D3DCLEAR_TARGET, 0, 1.f, 0);
+
+	// color blends as usual while alpha accumulates coverage, which leaves the texture premultiplied
+	device->SetRenderState(D3DRS_SEPARATEALPHABLENDENABLE, TRUE);
+	submit(std::span<const RenderListPtr>{ &layer.render_list, 1 });
+	device->SetRenderState(D3DRS_SEPARATEALPHABLENDENABLE, FALSE);
+
+	device->SetRenderTarget(0, prev_target);
+	device->SetDepthStencilSurface(prev_depth_stencil);
+	device->SetViewport(&prev_viewport);
+
+	safe_release(surface);
+	safe_release(prev_target);
+	safe_release(prev_depth_stencil);
+
+	layer.revision = layer.render_list->revision;
+	layer.dirty = false;
+}
+
+IDirect3DTexture9 *Renderer::get_batch_texture(const Batch &batch) const
+{
+	if (batch.layer_id == no_layer)
+		return batch.texture;
+
+	// lists replayed from a capture may name layers this renderer does not have
+	return batch.layer_id < std::size(layers) ? layers[batch.layer_id].texture : nullptr;
+}
+
+void Renderer::merge_batch(const Batch &batch)
+{
+	if (!std::empty(merged_batches))
+	{
+		Batch &last = merged_batches.back();
+
+		// only list topologies can be joined, strips must keep their own draw call
+		if (last.count && last.topology == batch.topology && last.texture == batch.texture && last.layer_id == batch.layer_id &&
+			is_toplogy_list(last.topology))
+		{
+			last.count += batch.count;
+			return;
+		}
+	}
+
+	merged_batches.push_back(batch);
+}
+
+void Renderer::merge_list(const RenderList &render_list)
+{
+	const std::vector<Batch> &batches = render_list.batches;
+
+	if (std::empty(batches))
+		return;
+
+	if (!instancing)
+	{
+		for (const auto &batch : batches)
+		{
+			if (batch.topology == quad_topology)
+				merge_batch(Batch{ 6 * batch.count, D3DPT_TRIANGLELIST, batch.texture, batch.layer_id });
+			else
+				merge_batch(batch);
+		}
+
+		return;
+	}
+
+	merge_batch(batches.front());
+	merged_batches.insert(std::end(merged_batches), std::next(std::begin(batches)), std::end(batches));
+}
+
+Vertex *Renderer::expand_list(Vertex *dst, const RenderList &render_list)
+{
+	std::size_t first = 0;
+	std::size_t tex_first = 0;
+	std::size_t quad_first = 0;
+
+	for (const auto &batch : render_list.batches)
+	{
+		if (!batch.count)
+			continue;
+
+		// without instancing quads are drawn as the triangle lists merge_list turned them into
+		if (batch.topology == quad_topology)
+		{
+			if (!instancing)
+			{
+				expand_quads(dst, &render_list.quads[quad_first], batch.count);
+				dst += 6 * batch.count;
+			}
+
+			quad_first += batch.count;
+			continue;
+		}
+
+		expand_vertices(dst, &render_list.vertices[first], batch.is_textured() ? &render_list.tex_coords[tex_first] : nullptr, batch.count);
+		dst += batch.count;
+
+		first += batch.count;
+		if (batch.is_textured())
+			tex_first += batch.count;
+	}
+
+	return dst;
+}
+
+Vertex *Renderer::gather_layered(Vertex *dst, const RenderList &render_list)
+{
+	render_list.sort_commands(sorted_commands, sort_scratch);
+
+	for (const auto &entry : sorted_commands)
+	{
+		const RenderList::Command &command = render_list.commands[entry.index];
+
+		expand_vertices(dst, &render_list.vertices[command.first],
+			command.is_textured() ? &render_list.tex_coords[command.tex_first] : nullptr, command.count);
+		dst += command.count;
+
+		merge_batch(Batch{ command.count, command.topology, command.texture, command.layer_id });
+
+		if (!is_toplogy_list(command.topology))
+			merged_batches.emplace_back(0, D3DPT_FORCE_DWORD, nullptr);
+	}
+
+	return dst;
+}
+
+void Renderer::draw_batch(const Batch &batch, std::size_t start)
+{
+	std::uint32_t primitive_count = get_primitive_count(batch.topology, batch.count);
+	if (primitive_count == 0)
+		return;
+
+	if (instancing_bound)
+		unbind_instancing();
+
+	device->SetTexture(0, get_batch_texture(batch));
+
+	// layers are premultiplied
+	if (batch.layer_id != no_layer)
+	{
+		device->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_ONE);
+		device->DrawPrimitive(batch.topology, start, primitive_count);
+		device->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+	}
+	else
+		device->DrawPrimitive(batch.topology, start, primitive_count);
+}
+
+void Renderer::grow_vertex_buffer(std::size_t num_vertices)
+{
+	max_vertices = num_vertices;
+
+	// textures and the state block captured in begin() stay, only what references the buffer is recreated
+	release_vertex_buffer();
+	create_vertex_buffer();
+
+	safe_release(render_state_block);
+	render_state_block = record_state_block();
+
+	device->SetStreamSource(0, vertex_buffer, 0, sizeof(Vertex));
+}
+
+bool Renderer::is_immediate(const RenderListPtr &render_list) const
+{
+	// caller-owned lists never read immediate, which the device thread writes
+	return render_list->internal && immediate;
+}
+
+bool Renderer::can_instance(const RenderListPtr &render_list) const
+{
+	// layered lists sort vertex ranges and immediate mode writes vertices straight into the buffer
+	return instancing && !render_list->layered && !is_immediate(render_list);
+}
+
+std::span<QuadInstance> Renderer::reserve_quads(const RenderListPtr &render_list, std::size_t count, IDirect3DTexture9 *texture, std::size_t layer_id)
+{
+	std::size_t num_quads = std::size(render_list->quads);
+	if (std::empty(render_list->batches) || render_list->batches.back().topology != quad_topology || render_list->batches.back().texture != texture ||
+		render_list->batches.back().layer_id != layer_id)
+	{
+		render_list->batches.emplace_back(0, quad_topology, texture, layer_id);
+	}
+
+	render_list->batches.back().count += count;
+	render_list->quads.resize(num_quads + count);
+	++render_list->revision;
+
+	return { std::data(render_list->quads) + num_quads, count };
+}
+
+void Renderer::draw_quads(const Batch &batch, std::size_t start)
+{
+	if (!instancing_bound)
+		bind_instancing();
+
+	device->SetTexture(0, get_batch_texture(batch));
+	device->SetPixelShader(batch.is_textured() ? quad_texture_shader : quad_color_shader);
+
+	device->SetStreamSource(1, instance_buffer, static_cast<UINT>(start * sizeof(QuadInstance)), sizeof(QuadInstance));
+	device->SetStreamSourceFreq(0, D3DSTREAMSOURCE_INDEXEDDATA | static_cast<UINT>(batch.count));
+
+	if (batch.layer_id != no_layer)
+	{
+		device->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_ONE);
+		device->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0, 0, 4, 0, 2);
+		device->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+	}
+	else
+		device->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0, 0, 4, 0, 2);
+}
+
+void Renderer::begin_instancing()
+{
+	// the viewport changes while layers are drawn, so the transform is set up per submit
+	D3DVIEWPORT9 viewport;
+	device->GetViewport(&viewport);
+
+	float width = static_cast<float>(viewport.Width);
+	float height = static_cast<float>(viewport.Height);
+
+	const float transform[4]
+	{
+		2.f / width, -2.f / height, -1.f - 2.f * viewport.X / width, 1.f + 2.f * viewport.Y / height
+	};
+
+	// the fixed function path ignores the constant and the indices, so they stay set for the whole submit
+	device->SetVertexShaderConstantF(0, transform, 1);
+	device->SetIndices(quad_indices);
+}
+
+void Renderer::end_instancing()
+{
+	device->SetStreamSource(1, nullptr, 0, 0);
+	device->SetIndices(nullptr);
+}
+
+void Renderer::bind_instancing()
+{
+	device->SetVertexDeclaration(quad_declaration);
+	device->SetVertexShader(quad_vertex_shader);
+	device->SetStreamSource(0, quad_buffer, 0, sizeof(Vec2));
+	device->SetStreamSourceFreq(1, D3DSTREAMSOURCE_INSTANCEDATA | 1u);
+
+	instancing_bound = true;
+}
+
+void Renderer::unbind_instancing()
+{
+	device->SetStreamSourceFreq(0, 1);
+	device->SetStreamSourceFreq(1, 1);
+	device->SetStreamSource(0, vertex_buffer, 0, sizeof(Vertex));
+	device->SetVertexShader(nullptr);
+	device->SetPixelShader(nullptr);
+	device->SetFVF(vertex_definition);
+
+	instancing_bound = false;
+}
+
+void Renderer::grow_instance_buffer(std::size_t num_quads)
+{
+	max_quads = num_quads;
+
+	safe_release(instance_buffer);
+	throw_if_failed(device->CreateVertexBuffer(max_quads * sizeof(QuadInstance), D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY,
+		0, D3DPOOL_DEFAULT, &instance_buffer, nullptr));
+}
+
+Vertex *Renderer::allocate_immediate(std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture, std::size_t layer_id)
+{
+	expand_immediate();
+
+	bool mergeable = immediate_batch.topology == topology && immediate_batch.texture == texture && immediate_batch.layer_id == layer_id &&
+		topology != D3DPT_LINESTRIP && topology != D3DPT_TRIANGLESTRIP;
+
+	if (!mergeable || immediate_offset + count > max_vertices)
+		flush_immediate();
+
+	if (count > max_vertices)
+		grow_vertex_buffer(count);
+
+	if (immediate_offset + count > max_vertices)
+		immediate_offset = 0;
+
+	if (!immediate_data)
+	{
+		void *data;
+		throw_if_failed(vertex_buffer->Lock(0, 0, &data, immediate_offset ? D3DLOCK_NOOVERWRITE : D3DLOCK_DISCARD));
+		immediate_data = static_cast<Vertex *>(data);
+	}
+
+	if (immediate_batch.count == 0)
+	{
+		immediate_batch = Batch{ 0, topology, texture, layer_id };
+		immediate_start = immediate_offset;
+	}
+
+	Vertex *v = immediate_data + immediate_offset;
+
+	immediate_batch.count += count;
+	immediate_offset += count;
+
+	return v;
+}
+
+VertexSpan Renderer::reserve_immediate(std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture, std::size_t layer_id)
+{
+	allocate_immediate(count, topology, texture, layer_id);
+
+	// handed out in the recording format like any list, expanded into the allocated range by the next append or flush
+	immediate_vertices.resize(count);
+	immediate_tex_coords.resize(immediate_batch.is_textured() ? count : 0);
+
+	return { immediate_vertices, immediate_tex_coords };
+}
+
+void Renderer::expand_immediate()
+{
+	if (std::empty(immediate_vertices))
+		return;
+
+	std::size_t count = std::size(immediate_vertices);
+
+	expand_vertices(immediate_data + immediate_offset - count, std::data(immediate_vertices),
+		std::empty(immediate_tex_coords) ? nullptr : std::data(immediate_tex_coords), count);
+
+	immediate_vertices.clear();
+	immediate_tex_coords.clear();
+}
+
+void Renderer::flush_immediate()
+{
+	if (immediate_data)
+	{
+		expand_immediate();
+		vertex_buffer->Unlock();
+		immediate_data = nullptr;
+	}
+
+	if (immediate_batch.count && topology_order(immediate_batch.topology) > 0)
+		draw_batch(immediate_batch, immediate_start);
+
+	immediate_batch = Batch{ 0, D3DPT_FORCE_DWORD };
+}
+
+FontHandle Renderer::create_font(const std::string &family, long size, std::uint8_t flags)
+{
+	fonts.push_back(std::make_unique<Font>(make_ptr(), device, family.c_str(), size, flags));
+	name_capture_textures();
+
+	return FontHandle{ fonts.size() - 1 };
+}
+
+namespace /* anonymous namespace */
+{
+	void pack_vertices(CompactVertex *dst, Vec2 *tex_coords, const Vertex *src, std::size_t count)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+			dst[i] = CompactVertex{ src[i].position.x, src[i].position.y, src[i].color };
+
+		if (tex_coords)
+		{
+			for (std::size_t i = 0; i < count; ++i)
+				tex_coords[i] = src[i].tex;
+		}
+	}
+};
+
+void expand_vertices(Vertex *dst, const CompactVertex *src, const Vec2 *tex_coords, std::size_t count)
+{
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 zero = _mm_setzero_ps();
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		// { x, y } | { 1, 1 } -> position, then color and tex in one 12 byte tail
+		__m128 xy = _mm_loadl_pi(zero, reinterpret_cast<const __m64 *>(&src[i].x));
+		_mm_storeu_ps(&dst[i].position.x, _mm_movelh_ps(xy, one));
+
+		dst[i].color = src[i].color;
+		dst[i].tex = tex_coords ? tex_coords[i] : Vec2{ 0.f, 0.f };
+	}
+}
+
+VertexSpan Renderer::allocate_vertices(const RenderListPtr &render_list, std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture, std::size_t layer_id)
+{
+	std::size_t num_vertices = std::size(render_list->vertices);
+	std::size_t num_tex_coords = std::size(render_list->tex_coords);
+	bool textured = texture || layer_id != no_layer;
+
+	render_list->vertices.resize(num_vertices + count);
+	++render_list->revision;
+
+	if (textured)
+		render_list->tex_coords.resize(num_tex_coords + count);
+
+	// layered lists are drawn from their commands alone
+	if (render_list->layered)
+	{
+		render_list->add_command(num_vertices, num_tex_coords, count, topology, texture, layer_id);
+	}
+	else
+	{
+		if (std::empty(render_list->batches) || render_list->batches.back().topology != topology || render_list->batches.back().texture != texture ||
+			render_list->batches.back().layer_id != layer_id)
+		{
+			render_list->batches.emplace_back(0, topology, texture, layer_id);
+		}
+
+		render_list->batches.back().count += count;
+
+		switch (topology)
+		{
+		case D3DPT_LINESTRIP:
+		case D3DPT_TRIANGLESTRIP:
+			render_list->batches.emplace_back(0, D3DPT_FORCE_DWORD, nullptr);
+		default:
+			break;
+		}
+	}
+
+	return
+	{
+		{ std::data(render_list->vertices) + num_vertices, count },
+		textured ? std::span<Vec2>{ std::data(render_list->tex_coords) + num_tex_coords, count } : std::span<Vec2>{}
+	};
+}
+
+VertexSpan Renderer::reserve_vertices(const RenderListPtr &render_list, std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture)
+{
+	if (is_immediate(render_list))
+		return reserve_immediate(count, topology, texture);
+
+	return allocate_vertices(render_list, count, topology, texture);
+}
+
+VertexSpan Renderer::reserve_vertices(std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture)
+{
+	return reserve_vertices(render_list, count, topology, texture);
+}
+
+void Renderer::add_vertices(const RenderListPtr &render_list, std::span<const Vertex> vertices, ToplogyType topology, IDirect3DTexture9 *texture)
+{
+	if (is_immediate(render_list))
+	{
+		Vertex *v = allocate_immediate(std::size(vertices), topology, texture);
+		std::memcpy(v, std::data(vertices), std::size(vertices) * sizeof(Vertex));
+		return;
+	}
+
+	VertexSpan v = allocate_vertices(render_list, std::size(vertices), topology, texture);
+
+	pack_vertices(std::data(v.vertices), std::empty(v.tex_coords) ? nullptr : std::data(v.tex_coords), std::data(vertices), std::size(vertices));
+}
+
+void Renderer::add_vertices(std::span<const Vertex> vertices, ToplogyType topology, IDirect3DTexture9 *texture)
+{
+	add_vertices(render_list, vertices, topology, texture);
+}
+
+namespace /* anonymous namespace */
+{
+	// Stores the low x/y pair of xy, Vertex gets z and rhw of 1 like expand_vertices.
+	inline void store_xy(CompactVertex &v, __m128 xy)
+	{
+		_mm_storel_pi(reinterpret_cast<__m64 *>(&v.x), xy);
+	}
+
+	inline void store_xy(Vec2 &v, __m128 xy)
+	{
+		_mm_storel_pi(reinterpret_cast<__m64 *>(&v.x), xy);
+	}
+
+	inline void store_xy(Vertex &v, __m128 xy)
+	{
+		_mm_storeu_ps(&v.position.x, _mm_movelh_ps(xy, _mm_set1_ps(1.f)));
+	}
+
+	// Writes the six corners of the two triangles of a quad given as { x0, y0, x1, y1 } in the winding of
+	// draw_filled_rect, Ty is anything store_xy takes (CompactVertex or Vertex for positions, Vec2 for tex coords).
+	template <typename Ty>
+	inline void emit_corners(Ty *v, __m128 corners)
+	{
+		__m128 top_right    = _mm_shuffle_ps(corners, corners, _MM_SHUFFLE(0, 0, 1, 2));
+		__m128 bottom_left  = _mm_shuffle_ps(corners, corners, _MM_SHUFFLE(0, 0, 3, 0));
+		__m128 bottom_right = _mm_movehl_ps(corners, corners);
+
+		store_xy(v[0], corners);
+		store_xy(v[1], top_right);
+		store_xy(v[2], bottom_left);
+		store_xy(v[3], top_right);
+		store_xy(v[4], bottom_right);
+		store_xy(v[5], bottom_left);
+	}
+
+	template <typename Ty>
+	inline void emit_quad(Ty *v, __m128 corners, Color color)
+	{
+		emit_corners(v, corners);
 
-Renderer::~Renderer()
+		for (int i = 0; i < 6; ++i)
+		{
+			v[i].color = color;
+
+			if constexpr (std::is_same_v<Ty, Vertex>)
+				v[i].tex = Vec2{ 0.f, 0.f };
+		}
+	}
+
+	// The kernels below write either the recording format or, in immediate mode, Vertex straight into the
+	// locked buffer, see Renderer::emit_vertices.
+
+	// rect { x, y, w, h } -> corners { x, y, x + w, y + h }
+	template <typename Ty>
+	void expand_rects(Ty *v, const Vec4 *rects, const Color *colors, std::size_t color_stride, std::size_t count)
+	{
+		const __m128 size_mask = _mm_castsi128_ps(_mm_set_epi32(-1, -1, 0, 0));
+
+		for (std::size_t i = 0; i < count; ++i, v += 6)
+		{
+			__m128 rect = _mm_loadu_ps(&rects[i].x);
+			__m128 corners = _mm_add_ps(_mm_movelh_ps(rect, rect), _mm_and_ps(rect, size_mask));
+
+			emit_quad(v, corners, colors[i * color_stride]);
+		}
+	}
+
+	// position { x, y } -> corners { x, y, x + 1, y + 1 }
+	template <typename Ty>
+	void expand_pixels(Ty *v, const Vec2 *positions, const Color *colors, std::size_t color_stride, std::size_t count)
+	{
+		const __m128 size = _mm_set_ps(1.f, 1.f, 0.f, 0.f);
+
+		for (std::size_t i = 0; i < count; ++i, v += 6)
+		{
+			__m128 position = _mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64 *>(&positions[i].x));
+			__m128 corners = _mm_add_ps(_mm_movelh_ps(position, position), size);
+
+			emit_quad(v, corners, colors[i * color_stride]);
+		}
+	}
+
+	// points { from, to } pairs -> two line list vertices per pair
+	template <typename Ty>
+	void expand_lines(Ty *v, const Vec2 *points, const Color *colors, std::size_t color_stride, std::size_t count)
+	{
+		for (std::size_t i = 0; i < count; ++i, v += 2)
+		{
+			__m128 line = _mm_loadu_ps(&points[2 * i].x);
+
+			store_xy(v[0], line);
+			store_xy(v[1], _mm_movehl_ps(line, line));
+
+			v[0].color = v[1].color = colors[i * color_stride];
+
+			if constexpr (std::is_same_v<Ty, Vertex>)
+				v[0].tex = v[1].tex = Vec2{ 0.f, 0.f };
+		}
+	}
+
+	// instance { rect, uv, color } -> the two triangles of emit_quad, uvs only when tex_coords is given
+	// or the vertices carry their own
+	template <typename Ty>
+	void expand_quads(Ty *v, Vec2 *tex_coords, const QuadInstance *quads, std::size_t count)
+	{
+		const __m128 size_mask = _mm_castsi128_ps(_mm_set_epi32(-1, -1, 0, 0));
+
+		for (std::size_t i = 0; i < count; ++i, v += 6)
+		{
+			__m128 rect = _mm_loadu_ps(&quads[i].rect.x);
+			__m128 corners = _mm_add_ps(_mm_movelh_ps(rect, rect), _mm_and_ps(rect, size_mask));
+
+			emit_quad(v, corners, quads[i].color);
+
+			if constexpr (std::is_same_v<Ty, Vertex>)
+			{
+				Vec2 uv[6];
+				emit_corners(uv, _mm_loadu_ps(&quads[i].uv.x));
+
+				for (int j = 0; j < 6; ++j)
+					v[j].tex = uv[j];
+			}
+			else if (tex_coords)
+			{
+				emit_corners(tex_coords, _mm_loadu_ps(&quads[i].uv.x));
+				tex_coords += 6;
+			}
+		}
+	}
+
+	void rects_to_quads(QuadInstance *quads, const Vec4 *rects, const Color *colors, std::size_t color_stride, std::size_t count)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+			quads[i] = QuadInstance{ rects[i], Vec4{ 0.f, 0.f, 0.f, 0.f }, colors[i * color_stride] };
+	}
+
+	void pixels_to_quads(QuadInstance *quads, const Vec2 *positions, const Color *colors, std::size_t color_stride, std::size_t count)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+			quads[i] = QuadInstance{ Vec4{ positions[i].x, positions[i].y, 1.f, 1.f }, Vec4{ 0.f, 0.f, 0.f, 0.f }, colors[i * color_stride] };
+	}
+};
+
+template <typename Kernel>
+void Renderer::emit_vertices(const RenderListPtr &render_list, std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture,
+	std::size_t layer_id, Kernel &&kernel)
 {
-	release();
+	// immediate mode skips the recording format, the kernel writes Vertex into the locked buffer
+	if (is_immediate(render_list))
+	{
+		kernel(allocate_immediate(count, topology, texture, layer_id), static_cast<Vec2 *>(nullptr));
+		return;
+	}
+
+	VertexSpan v = allocate_vertices(render_list, count, topology, texture, layer_id);
+	kernel(std::data(v.vertices), std::empty(v.tex_coords) ? nullptr : std::data(v.tex_coords));
 }
 
-void Renderer::reacquire()
+void Renderer::add_quads(const RenderListPtr &render_list, std::span<const QuadInstance> quads, IDirect3DTexture9 *texture)
 {
-	throw_if_failed(device->CreateVertexBuffer(max_vertices * sizeof(Vertex), D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY,
-		vertex_definition, D3DPOOL_DEFAULT, &vertex_buffer, nullptr));
-
-	for (int i = 0; i < 2; ++i)
+	if (can_instance(render_list))
 	{
-		device->BeginStateBlock();
+		std::span<QuadInstance> q = reserve_quads(render_list, std::size(quads), texture);
+		std::memcpy(std::data(q), std::data(quads), std::size(quads) * sizeof(QuadInstance));
+		return;
+	}
 
-		device->SetRenderState(D3DRS_ZENABLE, FALSE);
+	emit_vertices(render_list, 6 * std::size(quads), D3DPT_TRIANGLELIST, texture, no_layer,
+		[&](auto *v, Vec2 *tex_coords) { expand_quads(v, tex_coords, std::data(quads), std::size(quads)); });
+}
 
-		device->SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
-		device->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
-		device->SetRenderState(D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
-
-		device->SetRenderState(D3DRS_ALPHATESTENABLE, TRUE);
-		device->SetRenderState(D3DRS_ALPHAREF, 0x08);
-		device->SetRenderState(D3DRS_ALPHAFUNC, D3DCMP_GREATEREQUAL);
-
-		device->SetRenderState(D3DRS_LIGHTING, FALSE);
-
-		device->SetRenderState(D3DRS_FILLMODE, D3DFILL_SOLID);
-		device->SetRenderState(D3DRS_CULLMODE, D3DCULL_CCW);
-		device->SetRenderState(D3DRS_STENCILENABLE, FALSE);
-		device->SetRenderState(D3DRS_CLIPPING, TRUE);
-		device->SetRenderState(D3DRS_CLIPPLANEENABLE, FALSE);
-		device->SetRenderState(D3DRS_VERTEXBLEND, D3DVBF_DISABLE);
-		device->SetRenderState(D3DRS_INDEXEDVERTEXBLENDENABLE, FALSE);
-		device->SetRenderState(D3DRS_FOGENABLE, FALSE);
-		device->SetRenderState(D3DRS_COLORWRITEENABLE,
-			D3DCOLORWRITEENABLE_RED | D3DCOLORWRITEENABLE_GREEN |
-			D3DCOLORWRITEENABLE_BLUE | D3DCOLORWRITEENABLE_ALPHA);
-
-		device->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
-		device->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
-		device->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
-		device->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_MODULATE);
-		device->SetTextureStageState(0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
-		device->SetTextureStageState(0, D3DTSS_ALPHAARG2, D3DTA_DIFFUSE);
-		device->SetTextureStageState(0, D3DTSS_TEXCOORDINDEX, 0);
-		device->SetTextureStageState(0, D3DTSS_TEXTURETRANSFORMFLAGS, D3DTTFF_DISABLE);
-		device->SetTextureStageState(1, D3DTSS_COLOROP, D3DTOP_DISABLE);
-		device->SetTextureStageState(1, D3DTSS_ALPHAOP, D3DTOP_DISABLE);
-		device->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_POINT);
-		device->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_POINT);
-		device->SetSamplerState(0, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
-		
-		device->SetFVF(vertex_definition);
-		device->SetTexture(0, nullptr);
-		device->SetStreamSource(0, vertex_buffer, 0, sizeof(Vertex));
-		device->SetPixelShader(nullptr);
-
-		if (i != 0)
-			device->EndStateBlock(&prev_state_block);
-		else
-			device->EndStateBlock(&render_state_block);
-	}
+void Renderer::add_quads(std::span<const QuadInstance> quads, IDirect3DTexture9 *texture)
+{
+	add_quads(render_list, quads, texture);
 }
 
-void Renderer::release()
+void expand_quads(Vertex *dst, const QuadInstance *quads, std::size_t count)
 {
-	safe_release(vertex_buffer);
-	safe_release(prev_state_block);
-	safe_release(render_state_block);
+	expand_quads(dst, static_cast<Vec2 *>(nullptr), quads, count);
 }
 
-void Renderer::begin()
+bool Renderer::is_instancing() const
 {
-	prev_state_block->Capture();
-	render_state_block->Apply();
+	return instancing;
 }
 
-void Renderer::end()
+ImageHandle Renderer::create_image(const std::uint32_t *pixels, long width, long height)
 {
-	prev_state_block->Apply();
+	ImageHandle image{ atlas->add_image(pixels, width, height) };
+	name_capture_textures();
+
+	return image;
 }
 
-void Renderer::draw(const RenderListPtr &render_list)
+ImageHandle Renderer::create_image(const std::string &file)
 {
-	std::size_t num_vertices = std::size(render_list->vertices);
-	if (num_vertices > 0)
-	{
-		void *data;
+	ImageHandle image{ atlas->add_image(file) };
+	name_capture_textures();
 
-		if (num_vertices > max_vertices)
-		{
-			max_vertices = num_vertices;
-			release();
-			reacquire();
-		}
+	return image;
+}
 
-		throw_if_failed(vertex_buffer->Lock(0, 0, &data, D3DLOCK_DISCARD));
-		{
-			std::memcpy(data, std::data(render_list->vertices), sizeof(Vertex) * num_vertices);
-		}
-		vertex_buffer->Unlock();
-	}
+std::vector<AtlasPageStats> Renderer::get_atlas_stats()
+{
+	return atlas->get_stats();
+}
 
-	std::size_t pos = 0;
+LayerHandle Renderer::create_layer(long width, long height, bool layered /* = false */)
+{
+	if (width <= 0 || height <= 0)
+		throw std::exception(fmt::format("Renderer::create_layer: Bad layer size ({}x{})!", width, height).c_str());
 
-	Batch &prev_batch = render_list->batches.front();
+	// layer contents are only premultiplied if alpha blends separately while they are rendered
+	D3DCAPS9 caps;
+	throw_if_failed(device->GetDeviceCaps(&caps));
 
-	for (const auto &batch : render_list->batches)
-	{
-		int order = topology_order(batch.topology);
-		if (batch.count && order > 0)
-		{
-			std::uint32_t primitive_count = batch.count;
+	if (!(caps.PrimitiveMiscCaps & D3DPMISCCAPS_SEPARATEALPHABLEND))
+		throw std::exception("Renderer::create_layer: Device does not support separate alpha blending!");
 
-			if (is_toplogy_list(batch.topology))
-				primitive_count /= order;
-			else
-				primitive_count -= (order - 1);
+	Layer layer{ make_render_list(layered), width, height, nullptr, 0, true };
 
-			device->SetTexture(0, batch.texture);
-			device->DrawPrimitive(batch.topology, pos, primitive_count);
-			pos += batch.count;
-		}
-	}
+	throw_if_failed(device->CreateTexture(width, height, 1, D3DUSAGE_RENDERTARGET, D3DFMT_A8R8G8B8,
+		D3DPOOL_DEFAULT, &layer.texture, nullptr));
+
+	layers.push_back(layer);
+	name_capture_textures();
+
+	return LayerHandle{ layers.size() - 1 };
 }
 
-void Renderer::draw()
+RenderListPtr Renderer::get_layer_list(LayerHandle layer)
 {
-	draw(render_list);
-	render_list->clear();
+	if (layer.id >= std::size(layers))
+		throw std::exception(fmt::format("Renderer::get_layer_list: Bad layer handle (identifier: {})!", layer.id).c_str());
+
+	return layers[layer.id].render_list;
 }
 
-FontHandle Renderer::create_font(const std::string &family, long size, std::uint8_t flags)
+void Renderer::invalidate_layer(LayerHandle layer)
 {
-	fonts.push_back(std::make_unique<Font>(make_ptr(), device, family.c_str(), size, flags));
-	return FontHandle{ fonts.size() - 1 };
+	if (layer.id >= std::size(layers))
+		throw std::exception(fmt::format("Renderer::invalidate_layer: Bad layer handle (identifier: {})!", layer.id).c_str());
+
+	layers[layer.id].dirty = true;
 }
 
 void Renderer::draw_filled_rect(const RenderListPtr &render_list, const Vec4 &rect, Color color)
 {
-	Vertex v[]
+	QuadInstance quad{ rect, Vec4{ 0.f, 0.f, 0.f, 0.f }, color };
+	add_quads(render_list, { &quad, 1 });
+}
+
+void Renderer::draw_filled_rect(const Vec4 &rect, Color color)
+{
+	draw_filled_rect(render_list, rect, color);
+}
+
+void Renderer::draw_filled_rects(const RenderListPtr &render_list, std::span<const Vec4> rects, std::span<const Color> colors)
+{
+	if (std::size(colors) != std::size(rects))
+		throw std::exception(fmt::format("Renderer::draw_filled_rects: Got {} colors for {} rects!", std::size(colors), std::size(rects)).c_str());
+
+	if (can_instance(render_list))
 	{
-		{ rect.x,          rect.y,          color },
-		{ rect.x + rect.z, rect.y,          color },
-		{ rect.x,          rect.y + rect.w, color },
+		std::span<QuadInstance> q = reserve_quads(render_list, std::size(rects), nullptr);
+		rects_to_quads(std::data(q), std::data(rects), std::data(colors), 1, std::size(rects));
+		return;
+	}
 
-		{ rect.x + rect.z, rect.y,          color },
-		{ rect.x + rect.z, rect.y + rect.w, color },
-		{ rect.x,          rect.y + rect.w, color }
-	};
+	emit_vertices(render_list, 6 * std::size(rects), D3DPT_TRIANGLELIST, nullptr, no_layer,
+		[&](auto *v, Vec2 *) { expand_rects(v, std::data(rects), std::data(colors), 1, std::size(rects)); });
+}
 
-	add_vertices(render_list, v, D3DPT_TRIANGLELIST);
+void Renderer::draw_filled_rects(std::span<const Vec4> rects, std::span<const Color> colors)
+{
+	draw_filled_rects(render_list, rects, colors);
 }
 
-void Renderer::draw_filled_rect(const Vec4 &rect, Color color)
+void Renderer::draw_filled_rects(const RenderListPtr &render_list, std::span<const Vec4> rects, Color color)
 {
-	draw_filled_rect(render_list, rect, color);
+	if (can_instance(render_list))
+	{
+		std::span<QuadInstance> q = reserve_quads(render_list, std::size(rects), nullptr);
+		rects_to_quads(std::data(q), std::data(rects), &color, 0, std::size(rects));
+		return;
+	}
+
+	emit_vertices(render_list, 6 * std::size(rects), D3DPT_TRIANGLELIST, nullptr, no_layer,
+		[&](auto *v, Vec2 *) { expand_rects(v, std::data(rects), &color, 0, std::size(rects)); });
+}
+
+void Renderer::draw_filled_rects(std::span<const Vec4> rects, Color color)
+{
+	draw_filled_rects(render_list, rects, color);
 }
 
 void Renderer::draw_rect(const RenderListPtr &render_list, const Vec4 &rect, float stroke_width, Color color)
 {
-	draw_filled_rect(render_list, { rect.x, rect.y, rect.z, stroke_width }, color);
-	draw_filled_rect(render_list, { rect.x, rect.y + rect.w - stroke_width, rect.z, stroke_width }, color);
-	draw_filled_rect(render_list, { rect.x, rect.y, stroke_width, rect.w }, color);
-	draw_filled_rect(render_list, { rect.x + rect.z - stroke_width, rect.y, stroke_width, rect.w }, color);
+	std::array<Vec4, 4> edges = get_rect_edges(rect, stroke_width);
+
+	draw_filled_rects(render_list, edges, color);
 }
 
 void Renderer::draw_rect(const Vec4 &rect, float stroke_width, Color color)
@@ -184,14 +1275,17 @@ void Renderer::draw_rect(const Vec4 &rect, float stroke_width, Color color)
 
 void Renderer::draw_outlined_rect(const RenderListPtr &render_list, const Vec4 &rect, float stroke_width, Color outline_color, Color rect_color)
 {
-	draw_filled_rect(render_list, rect, rect_color);
-	draw_rect(render_list, rect, stroke_width, outline_color);
+	std::array<Vec4, 4> edges = get_rect_edges(rect, stroke_width);
+	Vec4 rects[] { rect, edges[0], edges[1], edges[2], edges[3] };
+
+	Color colors[] { rect_color, outline_color, outline_color, outline_color, outline_color };
+
+	draw_filled_rects(render_list, rects, colors);
 }
 
 void Renderer::draw_outlined_rect(const Vec4 &rect, float stroke_width, Color outline_color, Color rect_color)
 {
-	draw_filled_rect(render_list, rect, rect_color);
-	draw_rect(render_list, rect, stroke_width, outline_color);
+	draw_outlined_rect(render_list, rect, stroke_width, outline_color, rect_color);
 }
 
 void Renderer::draw_line(const RenderListPtr &render_list, const Vec2 &from, const Vec2 &to, Color color)
@@ -210,6 +1304,37 @@ void Renderer::draw_line(const Vec2 &from, const Vec2 &to, Color color)
 	draw_line(render_list, from, to, color);
 }
 
+void Renderer::draw_lines(const RenderListPtr &render_list, std::span<const Vec2> points, std::span<const Color> colors)
+{
+	if (std::size(points) % 2 != 0)
+		throw std::exception(fmt::format("Renderer::draw_lines: Got an odd number of points ({})!", std::size(points)).c_str());
+
+	if (std::size(colors) != std::size(points) / 2)
+		throw std::exception(fmt::format("Renderer::draw_lines: Got {} colors for {} lines!", std::size(colors), std::size(points) / 2).c_str());
+
+	emit_vertices(render_list, std::size(points), D3DPT_LINELIST, nullptr, no_layer,
+		[&](auto *v, Vec2 *) { expand_lines(v, std::data(points), std::data(colors), 1, std::size(points) / 2); });
+}
+
+void Renderer::draw_lines(std::span<const Vec2> points, std::span<const Color> colors)
+{
+	draw_lines(render_list, points, colors);
+}
+
+void Renderer::draw_lines(const RenderListPtr &render_list, std::span<const Vec2> points, Color color)
+{
+	if (std::size(points) % 2 != 0)
+		throw std::exception(fmt::format("Renderer::draw_lines: Got an odd number of points ({})!", std::size(points)).c_str());
+
+	emit_vertices(render_list, std::size(points), D3DPT_LINELIST, nullptr, no_layer,
+		[&](auto *v, Vec2 *) { expand_lines(v, std::data(points), &color, 0, std::size(points) / 2); });
+}
+
+void Renderer::draw_lines(std::span<const Vec2> points, Color color)
+{
+	draw_lines(render_list, points, color);
+}
+
 void Renderer::draw_radar(const RenderListPtr &render_list, const Vec2 &position, float size /* = 150.f */, float stroke_width /* = 1.f */, Color outline_color /* = 0UL */, Color rect_color /* = 0UL */)
 {
 	//draw_outlined_rect(Rect{ x, y, size, size }, strokeWidth, outlineColor, radarColor);
@@ -268,6 +1393,113 @@ void Renderer::draw_pixels(const Vec2 &position, float square, Color color /* =
 	draw_pixels(render_list, position, square, color);
 }
 
+void Renderer::draw_pixels(const RenderListPtr &render_list, std::span<const Vec2> positions, std::span<const Color> colors)
+{
+	if (std::size(colors) != std::size(positions))
+		throw std::exception(fmt::format("Renderer::draw_pixels: Got {} colors for {} pixels!", std::size(colors), std::size(positions)).c_str());
+
+	if (can_instance(render_list))
+	{
+		std::span<QuadInstance> q = reserve_quads(render_list, std::size(positions), nullptr);
+		pixels_to_quads(std::data(q), std::data(positions), std::data(colors), 1, std::size(positions));
+		return;
+	}
+
+	emit_vertices(render_list, 6 * std::size(positions), D3DPT_TRIANGLELIST, nullptr, no_layer,
+		[&](auto *v, Vec2 *) { expand_pixels(v, std::data(positions), std::data(colors), 1, std::size(positions)); });
+}
+
+void Renderer::draw_pixels(std::span<const Vec2> positions, std::span<const Color> colors)
+{
+	draw_pixels(render_list, positions, colors);
+}
+
+void Renderer::draw_pixels(const RenderListPtr &render_list, std::span<const Vec2> positions, Color color /* = 0UL */)
+{
+	if (can_instance(render_list))
+	{
+		std::span<QuadInstance> q = reserve_quads(render_list, std::size(positions), nullptr);
+		pixels_to_quads(std::data(q), std::data(positions), &color, 0, std::size(positions));
+		return;
+	}
+
+	emit_vertices(render_list, 6 * std::size(positions), D3DPT_TRIANGLELIST, nullptr, no_layer,
+		[&](auto *v, Vec2 *) { expand_pixels(v, std::data(positions), &color, 0, std::size(positions)); });
+}
+
+void Renderer::draw_pixels(std::span<const Vec2> positions, Color color /* = 0UL */)
+{
+	draw_pixels(render_list, positions, color);
+}
+
+void Renderer::draw_image(const RenderListPtr &render_list, ImageHandle image, const Vec4 &rect, Color color)
+{
+	if (image.id >= atlas->get_num_images())
+		throw std::exception(fmt::format("Renderer::draw_image: Bad image handle (identifier: {})!", image.id).c_str());
+
+	QuadInstance quad{ Vec4{ rect.x - 0.5f, rect.y - 0.5f, rect.z, rect.w }, atlas->get_tex_coords(image.id), color };
+	add_quads(render_list, { &quad, 1 }, atlas->get_texture(image.id));
+}
+
+void Renderer::draw_image(ImageHandle image, const Vec4 &rect, Color color)
+{
+	draw_image(render_list, image, rect, color);
+}
+
+void Renderer::draw_sprite(const RenderListPtr &render_list, ImageHandle image, const Vec2 &position, float scale, Color color)
+{
+	if (image.id >= atlas->get_num_images())
+		throw std::exception(fmt::format("Renderer::draw_sprite: Bad image handle (identifier: {})!", image.id).c_str());
+
+	Vec2 size = atlas->get_size(image.id);
+	draw_image(render_list, image, { position.x, position.y, size.x * scale, size.y * scale }, color);
+}
+
+void Renderer::draw_sprite(ImageHandle image, const Vec2 &position, float scale, Color color)
+{
+	draw_sprite(render_list, image, position, scale, color);
+}
+
+void Renderer::draw_layer(const RenderListPtr &render_list, LayerHandle layer, const Vec2 &position, Color color)
+{
+	if (layer.id >= std::size(layers))
+		throw std::exception(fmt::format("Renderer::draw_layer: Bad layer handle (identifier: {})!", layer.id).c_str());
+
+	Layer &source = layers[layer.id];
+
+	// immediate quads are drawn before the next draw() would refresh the layer
+	if (is_immediate(render_list) && (source.dirty || source.revision != source.render_list->revision))
+		update_layer(source);
+
+	// the layer is premultiplied, so the tint has to be as well
+	std::uint32_t alpha = color >> 24;
+	color = (color & 0xff000000) |
+		(((color >> 16 & 0xff) * alpha / 255) << 16) |
+		(((color >> 8 & 0xff) * alpha / 255) << 8) |
+		((color & 0xff) * alpha / 255);
+
+	QuadInstance quad
+	{
+		Vec4{ position.x - 0.5f, position.y - 0.5f, static_cast<float>(source.width), static_cast<float>(source.height) },
+		Vec4{ 0.f, 0.f, 1.f, 1.f }, color
+	};
+
+	// recorded by layer id, the texture is looked up when the batch is drawn
+	if (can_instance(render_list))
+	{
+		reserve_quads(render_list, 1, nullptr, layer.id)[0] = quad;
+		return;
+	}
+
+	emit_vertices(render_list, 6, D3DPT_TRIANGLELIST, nullptr, layer.id,
+		[&](auto *v, Vec2 *tex_coords) { expand_quads(v, tex_coords, &quad, 1); });
+}
+
+void Renderer::draw_layer(LayerHandle layer, const Vec2 &position, Color color)
+{
+	draw_layer(render_list, layer, position, color);
+}
+
 Vec2 Renderer::get_text_extent(FontHandle font, const std::string &text)
 {
 	return fonts[font.id]->get_text_extent(text.c_str());
@@ -292,14 +1524,19 @@ RendererPtr Renderer::make_ptr()
 	return shared_from_this();
 }
 
-RenderListPtr Renderer::make_render_list()
+RenderListPtr Renderer::make_render_list(bool layered /* = false */)
+{
+	return std::make_shared<RenderList>(max_vertices, layered);
+}
+
+Batch::Batch(std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture /*= nullptr*/, std::size_t layer_id /*= no_layer*/) :
+	count(count), topology(topology), texture(texture), layer_id(layer_id)
 {
-	return std::make_shared<RenderList>(max_vertices);
 }
 
-Batch::Batch(std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture /*= nullptr*/) :
-	count(count), topology(topology), texture(texture)
+bool Batch::is_textured() const
 {
+	return texture || layer_id != no_layer;
 }
 
 FontHandle::FontHandle(std::size_t id) :
@@ -307,6 +1544,16 @@ FontHandle::FontHandle(std::size_t id) :
 {
 }
 
+ImageHandle::ImageHandle(std::size_t id) :
+	id(id)
+{
+}
+
+LayerHandle::LayerHandle(std::size_t id) :
+	id(id)
+{
+}
+
 Vertex::Vertex(Vec4 position, Color color) : position(position), color(color)
 {
 }
@@ -331,7 +1578,8 @@ Vertex::Vertex(float x, float y, Color color) : position(x, y, 1.f, 1.f), color(
 {
 }
 
-RenderList::RenderList(std::size_t max_vertices)
+RenderList::RenderList(std::size_t max_vertices, bool layered /* = false */) :
+	layered(layered), internal(false), layer(0), revision(0)
 {
 	vertices.reserve(max_vertices);
 }
@@ -344,34 +1592,130 @@ RenderListPtr RenderList::make_ptr()
 void RenderList::clear()
 {
 	vertices.clear();
+	tex_coords.clear();
+	quads.clear();
 	batches.clear();
+	commands.clear();
+	layer = 0;
+	++revision;
 }
 
-namespace /* anonymous namespace */
+std::size_t RenderList::get_num_vertices() const
+{
+	return std::size(vertices);
+}
+
+std::size_t RenderList::get_num_quads() const
+{
+	return std::size(quads);
+}
+
+std::size_t RenderList::get_num_batches() const
+{
+	if (layered)
+		return std::size(commands);
+
+	return std::count_if(std::begin(batches), std::end(batches), [](const Batch &batch) { return batch.count > 0; });
+}
+
+void RenderList::set_layer(std::uint16_t layer)
+{
+	this->layer = layer;
+}
+
+void RenderList::add_command(std::size_t first, std::size_t tex_first, std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture, std::size_t layer_id)
+{
+	if (!std::empty(commands))
+	{
+		Command &last = commands.back();
+
+		// nothing can sort between two contiguous appends to the same layer, so extend the last command
+		if (last.layer() == layer && last.texture == texture && last.layer_id == layer_id && last.topology == topology &&
+			is_toplogy_list(topology) && last.first + last.count == first)
+		{
+			last.count += static_cast<std::uint32_t>(count);
+			return;
+		}
+	}
+
+	// commands are appended in order and the sort is stable, so the layer alone is enough of a key
+	std::uint64_t key = static_cast<std::uint64_t>(layer) << 48;
+
+	commands.push_back(Command{ key, static_cast<std::uint32_t>(first), static_cast<std::uint32_t>(tex_first),
+		static_cast<std::uint32_t>(count), topology, texture, layer_id });
+}
+
+void RenderList::sort_commands(std::vector<SortEntry> &sorted, std::vector<SortEntry> &scratch) const
 {
-	bool is_toplogy_list(D3DPRIMITIVETYPE topology)
+	std::size_t count = std::size(commands);
+
+	sorted.resize(count);
+	scratch.resize(count);
+
+	// LSD radix sort over the two layer bytes only, being stable it keeps append order within a layer.
+	// Both histograms in one sweep, a pass whose byte is identical for every key is skipped.
+	constexpr int first_byte = 6;
+	std::uint32_t histograms[8 - first_byte][256] = {};
+
+	for (std::size_t i = 0; i < count; ++i)
 	{
-		return topology == D3DPT_POINTLIST || topology == D3DPT_LINELIST || topology == D3DPT_TRIANGLELIST;
+		std::uint64_t key = commands[i].key;
+		sorted[i] = SortEntry{ key, static_cast<std::uint32_t>(i) };
+
+		for (int pass = 0; pass < 8 - first_byte; ++pass)
+			++histograms[pass][(key >> (8 * (first_byte + pass))) & 0xff];
 	}
 
-	int topology_order(D3DPRIMITIVETYPE topology)
+	for (int pass = 0; pass < 8 - first_byte; ++pass)
 	{
-		switch (topology)
+		std::uint32_t *histogram = histograms[pass];
+		int shift = 8 * (first_byte + pass);
+
+		if (count == 0 || histogram[(sorted[0].key >> shift) & 0xff] == count)
+			continue;
+
+		std::uint32_t offset = 0;
+		for (int digit = 0; digit < 256; ++digit)
 		{
-		case D3DPT_POINTLIST:
-			return 1;
-		case D3DPT_LINELIST:
-		case D3DPT_LINESTRIP:
-			return 2;
-		case D3DPT_TRIANGLELIST:
-		case D3DPT_TRIANGLESTRIP:
-		case D3DPT_TRIANGLEFAN:
-			return 3;
-		default:
-			return 0;
+			std::uint32_t n = histogram[digit];
+			histogram[digit] = offset;
+			offset += n;
 		}
+
+		for (const auto &entry : sorted)
+			scratch[histogram[(entry.key >> shift) & 0xff]++] = entry;
+
+		std::swap(sorted, scratch);
 	}
-};
+}
+
+SubmissionQueue::Submission::Submission(const RenderListPtr &render_list, std::uint32_t order) :
+	render_list(render_list), order(order)
+{
+}
+
+void SubmissionQueue::submit(const RenderListPtr &render_list, std::uint32_t order)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	submissions.emplace_back(render_list, order);
+}
+
+void SubmissionQueue::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	submissions.clear();
+}
+
+std::array<Vec4, 4> get_rect_edges(const Vec4 &rect, float stroke_width)
+{
+	return
+	{
+		Vec4{ rect.x,                         rect.y,                         rect.z,       stroke_width },
+		Vec4{ rect.x,                         rect.y + rect.w - stroke_width, rect.z,       stroke_width },
+		Vec4{ rect.x,                         rect.y,                         stroke_width, rect.w       },
+		Vec4{ rect.x + rect.z - stroke_width, rect.y,                         stroke_width, rect.w       }
+	};
+}
 
 void throw_if_failed(HRESULT hr)
 {
@@ -1,10 +1,14 @@
 #pragma once
 
+#include <array>
 #include <vector>
 #include <d3d9.h>
 #include <d3dx9.h>
 #include <memory>
 #include <exception>
+#include <span>
+#include <mutex>
+#include <algorithm>
 
 #include "format.h"
 
@@ -17,30 +21,129 @@ using Color = D3DCOLOR;
 using ToplogyType = D3DPRIMITIVETYPE;
 
 struct Vertex;
+struct CompactVertex;
+struct VertexSpan;
+struct QuadInstance;
 struct Batch;
+struct SortEntry;
 struct FontHandle;
+struct ImageHandle;
+struct LayerHandle;
+struct AtlasPageStats;
 
 class RenderList;
+class SubmissionQueue;
 class Renderer;
 
 using RenderListPtr = std::shared_ptr<RenderList>;
 using RendererPtr = std::shared_ptr<Renderer>;
 
 class Font;
+class Atlas;
+class CaptureWriter;
 
 #include "font.hpp"
+#include "atlas.hpp"
 
-namespace /* anonymous namespace */
+// Batches of this topology count QuadInstances of RenderList::quads instead of vertices.
+constexpr ToplogyType quad_topology = static_cast<ToplogyType>(0x7ffffffe);
+
+struct TopologyInfo
+{
+	int order; // vertices per primitive, 0 for topologies that are never drawn
+	bool list; // primitives share no vertices, so batches with the same key can be joined
+};
+
+// indexed by D3DPRIMITIVETYPE
+constexpr TopologyInfo topology_table[]
 {
-	bool is_toplogy_list(D3DPRIMITIVETYPE topology);
-	int topology_order(D3DPRIMITIVETYPE topology);
+	{ 0, false }, // unused
+	{ 1, true  }, // D3DPT_POINTLIST
+	{ 2, true  }, // D3DPT_LINELIST
+	{ 2, false }, // D3DPT_LINESTRIP
+	{ 3, true  }, // D3DPT_TRIANGLELIST
+	{ 3, false }, // D3DPT_TRIANGLESTRIP
+	{ 3, false }  // D3DPT_TRIANGLEFAN
 };
 
+constexpr TopologyInfo get_topology_info(ToplogyType topology)
+{
+	return topology >= D3DPT_POINTLIST && topology <= D3DPT_TRIANGLEFAN ? topology_table[topology] : TopologyInfo{ 0, false };
+}
+
+constexpr bool is_toplogy_list(ToplogyType topology)
+{
+	return get_topology_info(topology).list || topology == quad_topology;
+}
+
+constexpr int topology_order(ToplogyType topology)
+{
+	return get_topology_info(topology).order;
+}
+
+constexpr std::uint32_t get_primitive_count(ToplogyType topology, std::size_t count)
+{
+	TopologyInfo info = get_topology_info(topology);
+
+	if (info.order == 0 || count < static_cast<std::size_t>(info.order))
+		return 0;
+
+	return static_cast<std::uint32_t>(info.list ? count / info.order : count - (info.order - 1));
+}
+
+static_assert(get_primitive_count(D3DPT_TRIANGLELIST, 6) == 2 && get_primitive_count(D3DPT_TRIANGLESTRIP, 6) == 4 &&
+	get_primitive_count(D3DPT_LINESTRIP, 1) == 0 && !is_toplogy_list(D3DPT_TRIANGLEFAN), "topology_table is out of order!");
+
 void throw_if_failed(HRESULT hr);
 
 template <typename Ty>
 void safe_release(Ty &com_ptr);
 
+// Batches drawing a layer hold its index rather than its texture, which release()/reacquire() recreate.
+constexpr std::size_t no_layer = static_cast<std::size_t>(-1);
+
+struct Batch
+{
+	Batch(std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture = nullptr, std::size_t layer_id = no_layer);
+
+	// textured batches carry tex coords
+	bool is_textured() const;
+
+	std::size_t count;
+	ToplogyType topology;
+	IDirect3DTexture9 *texture;
+	std::size_t layer_id;
+};
+
+// Collects render lists recorded on any thread; Renderer::draw(SubmissionQueue &) takes them and merges
+// them sorted by order. Orders must be unique within a frame, as threads submit in no fixed order, draw()
+// throws otherwise.
+class SubmissionQueue
+{
+public:
+	void submit(const RenderListPtr &render_list, std::uint32_t order);
+	void clear();
+
+protected:
+	friend class Renderer;
+
+	struct Submission
+	{
+		Submission(const RenderListPtr &render_list, std::uint32_t order);
+
+		RenderListPtr render_list;
+		std::uint32_t order;
+	};
+
+	std::mutex              mutex;
+	std::vector<Submission> submissions;
+};
+
+// Recording into a caller-owned RenderList (every overload taking a RenderListPtr) touches no mutable
+// Renderer state, so each thread may record into its own list concurrently. Fonts, images and layers are
+// looked up by handle while recording, so they must all be created on the device thread before any
+// recording starts. The overloads without a RenderListPtr, immediate mode and all draw()s belong to the
+// device thread.
 class Renderer
 	: public std::enable_shared_from_this<Renderer>
 {
@@ -57,17 +160,67 @@ public:
 	void draw(const RenderListPtr &render_list);
 	void draw();
 
+	// Uploads all lists at once in the given order, joining compatible batches across list boundaries.
+	void draw(std::span<const RenderListPtr> render_lists);
+	// Takes the queued lists, submissions made while they draw are left for the next call.
+	void draw(SubmissionQueue &queue);
+
+	// While active, appends to the internal render list are written straight into the locked vertex buffer
+	// and drawn whenever the buffer fills up or the batch changes, instead of being deferred to draw().
+	void begin_immediate();
+	void end_immediate();
+
+	// Streams every draw() to the capture and marks frame boundaries in end(), pass nullptr to stop.
+	// Geometry streamed in immediate mode is not captured.
+	void set_capture(const std::shared_ptr<CaptureWriter> &capture);
+
 	FontHandle create_font(const std::string &family, long size, std::uint8_t flags = 0);
 
+	// Images are packed into shared atlas pages, pixels are tightly packed A8R8G8B8 rows.
+	ImageHandle create_image(const std::uint32_t *pixels, long width, long height);
+	ImageHandle create_image(const std::string &file);
+	std::vector<AtlasPageStats> get_atlas_stats();
+
+	// A layer caches its render list in an offscreen texture that draw() only redraws after the list was
+	// appended to or cleared, or after invalidate_layer(); drawing the layer itself costs a single quad.
+	// Layer contents are stored with premultiplied alpha and composited accordingly, which needs separate
+	// alpha blending; create_layer() throws on devices without it. Lists refer to layers by handle, so
+	// recorded draw_layer() quads stay valid across release()/reacquire().
+	LayerHandle create_layer(long width, long height, bool layered = false);
+	RenderListPtr get_layer_list(LayerHandle layer);
+	void invalidate_layer(LayerHandle layer);
+
 	template <std::size_t N>
 	void add_vertices(const RenderListPtr &render_list, const Vertex(&vertex_array)[N], ToplogyType topology, IDirect3DTexture9 *texture = nullptr);
 
 	template <std::size_t N>
 	void add_vertices(const Vertex(&vertex_array)[N], ToplogyType topology, IDirect3DTexture9 *texture = nullptr);
 
+	void add_vertices(const RenderListPtr &render_list, std::span<const Vertex> vertices, ToplogyType topology, IDirect3DTexture9 *texture = nullptr);
+	void add_vertices(std::span<const Vertex> vertices, ToplogyType topology, IDirect3DTexture9 *texture = nullptr);
+
+	// Quads are recorded as 36 byte instances and expanded by a vertex shader when the device supports
+	// vs_3_0 instancing. Layered lists, immediate mode and devices without instancing get six vertices per quad.
+	void add_quads(const RenderListPtr &render_list, std::span<const QuadInstance> quads, IDirect3DTexture9 *texture = nullptr);
+	void add_quads(std::span<const QuadInstance> quads, IDirect3DTexture9 *texture = nullptr);
+	bool is_instancing() const;
+
+	// Appends count vertices to the batch for topology/texture and returns the list's own storage for in-place
+	// writing: x, y and color, plus tex coords for textured batches. z and rhw are drawn as 1. The spans are
+	// invalidated by the next append to the same render list. In immediate mode they point to scratch that the
+	// next append or flush expands into the vertex buffer.
+	VertexSpan reserve_vertices(const RenderListPtr &render_list, std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture = nullptr);
+	VertexSpan reserve_vertices(std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture = nullptr);
+
 	void draw_filled_rect(const RenderListPtr &render_list, const Vec4 &rect, Color color = 0UL);
 	void draw_filled_rect(const Vec4 &rect, Color color = 0UL);
 
+	void draw_filled_rects(const RenderListPtr &render_list, std::span<const Vec4> rects, std::span<const Color> colors);
+	void draw_filled_rects(std::span<const Vec4> rects, std::span<const Color> colors);
+
+	void draw_filled_rects(const RenderListPtr &render_list, std::span<const Vec4> rects, Color color = 0UL);
+	void draw_filled_rects(std::span<const Vec4> rects, Color color = 0UL);
+
 	void draw_rect(const RenderListPtr &render_list, const Vec4 &rect, float stroke_width = 1.f, Color color = 0UL);
 	void draw_rect(const Vec4 &rect, float stroke_width = 1.f, Color color = 0UL);
 
@@ -77,6 +230,13 @@ public:
 	void draw_line(const RenderListPtr &render_list, const Vec2 &from, const Vec2 &to, Color color = 0UL);
 	void draw_line(const Vec2 &from, const Vec2 &to, Color color = 0UL);
 
+	// points holds consecutive from/to pairs, colors (if given) one entry per line.
+	void draw_lines(const RenderListPtr &render_list, std::span<const Vec2> points, std::span<const Color> colors);
+	void draw_lines(std::span<const Vec2> points, std::span<const Color> colors);
+
+	void draw_lines(const RenderListPtr &render_list, std::span<const Vec2> points, Color color = 0UL);
+	void draw_lines(std::span<const Vec2> points, Color color = 0UL);
+
 	void draw_circle(const RenderListPtr &render_list, const Vec2 &position, float radius, Color color = 0UL);
 	void draw_circle(const Vec2 &position, float radius, Color color = 0UL);
 
@@ -86,18 +246,85 @@ public:
 	void draw_pixels(const RenderListPtr &render_list, const Vec2 &position, float square, Color color = 0UL);
 	void draw_pixels(const Vec2 &position, float square, Color color = 0UL);
 
+	void draw_pixels(const RenderListPtr &render_list, std::span<const Vec2> positions, std::span<const Color> colors);
+	void draw_pixels(std::span<const Vec2> positions, std::span<const Color> colors);
+
+	void draw_pixels(const RenderListPtr &render_list, std::span<const Vec2> positions, Color color = 0UL);
+	void draw_pixels(std::span<const Vec2> positions, Color color = 0UL);
+
 	void draw_radar(const RenderListPtr &render_list, const Vec2 &position, float size = 150.f, float stroke_width = 1.f, Color outline_color = 0UL, Color rect_color = 0UL);
 	void draw_radar(const Vec2 &position, float size = 150.f, float stroke_width = 1.f, Color outline_color = 0UL, Color rect_color = 0UL);
 
+	void draw_image(const RenderListPtr &render_list, ImageHandle image, const Vec4 &rect, Color color = 0xffffffff);
+	void draw_image(ImageHandle image, const Vec4 &rect, Color color = 0xffffffff);
+
+	void draw_sprite(const RenderListPtr &render_list, ImageHandle image, const Vec2 &position, float scale = 1.f, Color color = 0xffffffff);
+	void draw_sprite(ImageHandle image, const Vec2 &position, float scale = 1.f, Color color = 0xffffffff);
+
+	void draw_layer(const RenderListPtr &render_list, LayerHandle layer, const Vec2 &position, Color color = 0xffffffff);
+	void draw_layer(LayerHandle layer, const Vec2 &position, Color color = 0xffffffff);
+
 	Vec2 get_text_extent(FontHandle font, const std::string &text);
 
 	void draw_text(const RenderListPtr &render_list, FontHandle font, Vec2 pos, const std::string& text, Color color = 0UL, std::uint8_t flags = 0);
 	void draw_text(FontHandle font, Vec2 position, const std::string &text, Color color = 0UL, std::uint8_t flags = 0);
 
 	RendererPtr make_ptr();
-	RenderListPtr make_render_list();
+
+	// Layered lists are drawn sorted by layer rather than in append order, appends to the same layer keep their order.
+	RenderListPtr make_render_list(bool layered = false);
 
 private:
+	struct Layer;
+
+	void create_vertex_buffer();
+	void release_vertex_buffer();
+	IDirect3DStateBlock9 *record_state_block();
+
+	void create_instancing();
+	void create_quad_buffers();
+	void release_quad_buffers();
+
+	void name_capture_textures();
+
+	void submit(std::span<const RenderListPtr> render_lists);
+	void update_layers();
+	void update_layer(Layer &layer);
+	IDirect3DTexture9 *get_batch_texture(const Batch &batch) const;
+
+	void merge_batch(const Batch &batch);
+	void merge_list(const RenderList &render_list);
+
+	Vertex *gather_layered(Vertex *dst, const RenderList &render_list);
+	void draw_batch(const Batch &batch, std::size_t start);
+	void grow_vertex_buffer(std::size_t num_vertices);
+
+	bool is_immediate(const RenderListPtr &render_list) const;
+	bool can_instance(const RenderListPtr &render_list) const;
+	VertexSpan allocate_vertices(const RenderListPtr &render_list, std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture, std::size_t layer_id = no_layer);
+	Vertex *expand_list(Vertex *dst, const RenderList &render_list);
+	std::span<QuadInstance> reserve_quads(const RenderListPtr &render_list, std::size_t count, IDirect3DTexture9 *texture, std::size_t layer_id = no_layer);
+	void draw_quads(const Batch &batch, std::size_t start);
+
+	// begin/end_instancing set up what quads need once per submit, bind/unbind_instancing switch between
+	// quad and vertex batches
+	void begin_instancing();
+	void end_instancing();
+	void bind_instancing();
+	void unbind_instancing();
+	void grow_instance_buffer(std::size_t num_quads);
+
+	// kernel(Vertex *, nullptr) writes into the locked buffer in immediate mode, kernel(CompactVertex *, tex coords)
+	// into the list otherwise, defined in renderer.cpp where the kernels live
+	template <typename Kernel>
+	void emit_vertices(const RenderListPtr &render_list, std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture,
+		std::size_t layer_id, Kernel &&kernel);
+
+	Vertex *allocate_immediate(std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture, std::size_t layer_id = no_layer);
+	VertexSpan reserve_immediate(std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture, std::size_t layer_id = no_layer);
+	void expand_immediate();
+	void flush_immediate();
+
 	IDirect3DDevice9                   *device;
 	IDirect3DVertexBuffer9             *vertex_buffer;
 	IDirect3DStateBlock9               *prev_state_block;
@@ -105,23 +332,70 @@ private:
 
 	std::size_t                        max_vertices;
 
+	bool                               instancing;
+	bool                               instancing_bound;
+	IDirect3DVertexDeclaration9        *quad_declaration;
+	IDirect3DVertexShader9             *quad_vertex_shader;
+	IDirect3DPixelShader9              *quad_texture_shader;
+	IDirect3DPixelShader9              *quad_color_shader;
+	IDirect3DVertexBuffer9             *quad_buffer;
+	IDirect3DIndexBuffer9              *quad_indices;
+	IDirect3DVertexBuffer9             *instance_buffer;
+	std::size_t                        max_quads;
+
 	RenderListPtr                      render_list;
 	std::vector<std::unique_ptr<Font>> fonts;
+	std::unique_ptr<Atlas>             atlas;
+	std::shared_ptr<CaptureWriter>     capture;
+
+	struct Layer
+	{
+		RenderListPtr     render_list;
+		long              width;
+		long              height;
+		IDirect3DTexture9 *texture;
+		std::uint64_t     revision;
+		bool              dirty;
+	};
+
+	std::vector<Layer>                 layers;
+
+	std::vector<Batch>                 merged_batches;
+	std::vector<SubmissionQueue::Submission> queued_submissions;
+	std::vector<RenderListPtr>         queued_lists;
+
+	std::vector<SortEntry>             sorted_commands;
+	std::vector<SortEntry>             sort_scratch;
+
+	bool                               immediate;
+	Vertex                             *immediate_data;
+	std::size_t                        immediate_offset;
+	std::size_t                        immediate_start;
+	Batch                              immediate_batch;
+	std::vector<CompactVertex>         immediate_vertices;
+	std::vector<Vec2>                  immediate_tex_coords;
 };
 
-struct Batch
+struct FontHandle
 {
-	Batch(std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture = nullptr);
+	FontHandle() = default;
+	explicit FontHandle(std::size_t id);
 
-	std::size_t count;
-	ToplogyType topology;
-	IDirect3DTexture9 *texture;
+	std::size_t id;
 };
 
-struct FontHandle
+struct ImageHandle
 {
-	FontHandle() = default;
-	explicit FontHandle(std::size_t id);
+	ImageHandle() = default;
+	explicit ImageHandle(std::size_t id);
+
+	std::size_t id;
+};
+
+struct LayerHandle
+{
+	LayerHandle() = default;
+	explicit LayerHandle(std::size_t id);
 
 	std::size_t id;
 };
@@ -145,21 +419,103 @@ struct Vertex
 	Vec2 tex{};
 };
 
+// Recording format of RenderList vertices, uvs live in RenderList::tex_coords for textured batches only.
+struct CompactVertex
+{
+	float x;
+	float y;
+	Color color;
+};
+
+// Storage handed out by reserve_vertices, tex_coords is empty unless the batch is textured.
+struct VertexSpan
+{
+	std::span<CompactVertex> vertices;
+	std::span<Vec2>          tex_coords;
+};
+
+// Expands recorded vertices to the FVF layout, tex_coords may be nullptr for untextured ranges.
+void expand_vertices(Vertex *dst, const CompactVertex *src, const Vec2 *tex_coords, std::size_t count);
+
+// Records the states Renderer draws with, stream 0 set to vertex_buffer. OverlayRenderer records the same
+// block for its own FVF, so both blend, alpha test and cull alike.
+IDirect3DStateBlock9 *record_render_states(IDirect3DDevice9 *device, unsigned long fvf, IDirect3DVertexBuffer9 *vertex_buffer, UINT stride);
+
+// The top, bottom, left and right edge of an outline of rect { x, y, w, h }.
+std::array<Vec4, 4> get_rect_edges(const Vec4 &rect, float stroke_width);
+
+// rect { x, y, w, h } in the same screen space as Vertex::position, uv { u0, v0, u1, v1 }
+struct QuadInstance
+{
+	Vec4 rect;
+	Vec4 uv;
+	Color color;
+};
+
+// Expands instances to the six triangle list vertices of each quad, for devices that cannot instance.
+void expand_quads(Vertex *dst, const QuadInstance *quads, std::size_t count);
+
+// A layered list command and its sort key, see RenderList::sort_commands.
+struct SortEntry
+{
+	std::uint64_t key;
+	std::uint32_t index;
+};
+
 class RenderList
 	: public std::enable_shared_from_this<RenderList>
 {
 public:
 	RenderList() = delete;
-	RenderList(std::size_t max_vertices);
+	RenderList(std::size_t max_vertices, bool layered = false);
 
 	RenderListPtr make_ptr();
 	void clear();
 
+	std::size_t get_num_vertices() const;
+	std::size_t get_num_quads() const;
+	std::size_t get_num_batches() const;
+
+	// Layer of subsequent appends, only used by layered lists. Reset to 0 by clear().
+	void set_layer(std::uint16_t layer);
+
 protected:
 	friend class Renderer;
-
-	std::vector<Vertex>	vertices;
+	friend class SoftwareRasterizer;
+	friend class CaptureWriter;
+	friend class CaptureReader;
+
+	// key: layer (16 bits) | unused (48 bits), layered lists record no batches
+	struct Command
+	{
+		std::uint16_t layer() const { return static_cast<std::uint16_t>(key >> 48); }
+		bool is_textured() const { return texture || layer_id != no_layer; }
+
+		std::uint64_t key;
+		std::uint32_t first;
+		std::uint32_t tex_first;
+		std::uint32_t count;
+		ToplogyType topology;
+		IDirect3DTexture9 *texture;
+		std::size_t layer_id;
+	};
+
+	void add_command(std::size_t first, std::size_t tex_first, std::size_t count, ToplogyType topology, IDirect3DTexture9 *texture, std::size_t layer_id);
+
+	// Radix-sorts the commands by layer into sorted, the drawing order of a layered list. Both vectors are
+	// caller-owned so their storage is reused across draws.
+	void sort_commands(std::vector<SortEntry> &sorted, std::vector<SortEntry> &scratch) const;
+
+	std::vector<CompactVertex>	vertices;
+	std::vector<Vec2>	tex_coords;
+	std::vector<QuadInstance> quads;
 	std::vector<Batch>	batches;
+
+	bool                            layered;
+	bool                            internal; // the Renderer's own list, set once at creation
+	std::uint16_t                   layer;
+	std::uint64_t                   revision;
+	std::vector<Command>            commands;
 };
 
 #include "renderer.inl"
\ No newline at end of file
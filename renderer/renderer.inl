@@ -3,25 +3,7 @@
 template <std::size_t N>
 void Renderer::add_vertices(const RenderListPtr &render_list, const Vertex(&vertex_array)[N], ToplogyType topology, IDirect3DTexture9 *texture)
 {
-	std::size_t num_vertices = std::size(render_list->vertices);
-	if (std::empty(render_list->batches) || render_list->batches.back().topology != topology || render_list->batches.back().texture != texture)
-	{
-		render_list->batches.emplace_back(0, topology, texture);
-	}
-
-	render_list->batches.back().count += N;
-
-	render_list->vertices.resize(num_vertices + N);
-	std::memcpy(&render_list->vertices[std::size(render_list->vertices) - N], &vertex_array[0], N * sizeof(Vertex));
-
-	switch (topology)
-	{
-	case D3DPT_LINESTRIP:
-	case D3DPT_TRIANGLESTRIP:
-		render_list->batches.emplace_back(0, D3DPT_FORCE_DWORD, nullptr);
-	default:
-		break;
-	}
+	add_vertices(render_list, std::span<const Vertex>{ vertex_array }, topology, texture);
 }
 
 template <std::size_t N>